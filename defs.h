@@ -5,12 +5,46 @@
 
 #include <stdio.h>
 
-/* if debuging is desired set value to 1 */
-#define DEBUG 0
-
 /* for now kernel printfs are just regular printfs */
 #define kprintf printf
 
+/*
+ * Tracing. TRACE(subsystem, level, (format, ...)) prints when level is at
+ * most the trace level of the subsystem. Levels are compile-time constants,
+ * so a disabled trace point compiles to nothing.
+ *
+ * TRACE_LEVEL is the level of every subsystem that does not set its own:
+ * building with e.g. -DTRACE_SCHED=TRACE_DEBUG traces the scheduler alone,
+ * and only the subsystem's own files need recompiling.
+ */
+#define TRACE_NONE 0
+#define TRACE_ERROR 1    /* failures reported to the caller */
+#define TRACE_INFO 2     /* thread creation and exit */
+#define TRACE_DEBUG 3    /* every context switch and interrupt */
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_ERROR
+#endif
+
+#ifndef TRACE_SCHED      /* minithread.c */
+#define TRACE_SCHED TRACE_LEVEL
+#endif
+
+#ifndef TRACE_INTR       /* interrupts.c, interrupts_linux.c */
+#define TRACE_INTR TRACE_LEVEL
+#endif
+
+/* what TRACE prints with; a file may define its own before including this */
+#ifndef TRACE_PRINTF
+#define TRACE_PRINTF kprintf
+#endif
+
+#define TRACE(subsystem, level, args) \
+  do { if ((level) <= (subsystem)) TRACE_PRINTF args; } while (0)
+
+/* interrupt debugging output, as a runtime test of a constant */
+#define DEBUG (TRACE_INTR >= TRACE_DEBUG)
+
 #ifdef WINCE
 /* Windows CE definitions */
 
@@ -45,7 +79,7 @@
     exit(1);\
   }
 
-#else /* Windows NT definitions */
+#elif defined(_WIN32) /* Windows NT definitions */
 #include <time.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -70,6 +104,30 @@
       exit(1);\
    }
 
+#else /* Linux definitions */
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+/* the NT sources spell 64 bit integers the Microsoft way */
+#define __int64 long long
+
+#define AbortOnCondition(cond,message) \
+ if (cond) {\
+    printf("Abort: %s:%d %s, MSG:%s\n", __FILE__, __LINE__, strerror(errno), message);\
+    exit(1);\
+ }
+
+/* POSIX calls report failure by returning -1 rather than FALSE */
+#define AbortOnError(fctcall) \
+   if ((fctcall) == -1) {\
+      printf("Error: file %s line %d: %s.\n", __FILE__, __LINE__, strerror(errno));\
+      exit(1);\
+   }
 
 #endif
 
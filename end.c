@@ -14,9 +14,16 @@ unsigned int end(void) {
 unsigned long end(void) {  
 #elif defined(_M_AMD64)
 unsigned __int64 end(void) {  
+#elif defined(__x86_64__)
+unsigned long end(void) {  
 #else
 #error "Arch not supported?"
 #endif
+#if defined(__x86_64__) && !defined(_WIN64)
+  /* glibc mangles the pc saved in a jmp_buf, so use a label address instead */
+here:
+  return (unsigned long) &&here;
+#else
   jmp_buf buf;
 
   setjmp(buf);
@@ -34,4 +41,5 @@ unsigned __int64 end(void) {
 #error "Arch not supported?"
 #endif
 #endif
+#endif
 }
@@ -0,0 +1,111 @@
+/*
+ * Binary event tracing of the scheduler; see eventtrace.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "eventtrace.h"
+#include "minithread.h"
+
+int eventtrace_enabled = 0;
+
+/* the ring; ring_head counts every event ever claimed, so the event
+   recorded n-th lives in ring[n & ring_mask] */
+static event_t* ring = NULL;
+static unsigned int ring_mask;
+static int ring_head;
+
+/* what each type is called in the exported trace */
+static char* event_names[] = {"switch", "fork", "exit", "P block", "V wakeup"};
+
+int eventtrace_start(int capacity) {
+  unsigned int size = 1;
+
+  eventtrace_enabled = 0;
+  if (capacity <= 0 || minithread_processor_count() > 1)
+    return -1;
+  while (size < (unsigned int) capacity)
+    size <<= 1;
+
+  free(ring);
+  ring = (event_t*) malloc(size * sizeof(event_t));
+  if (ring == NULL)
+    return -1;
+  ring_mask = size - 1;
+  ring_head = 0;
+
+  cyclesPerSecond();    /* calibrate now rather than at export */
+  eventtrace_enabled = 1;
+  return 0;
+}
+
+void eventtrace_stop() {
+  eventtrace_enabled = 0;
+}
+
+void eventtrace_record(int type, int thread, int other, void* object) {
+  event_t* event;
+  int slot;
+
+  do
+    slot = ring_head;
+  while (compare_and_swap(&ring_head, slot, (int) ((unsigned int) slot + 1)) != slot);
+
+  event = &ring[(unsigned int) slot & ring_mask];
+  event->time = currentTimeCycles();
+  event->type = type;
+  event->thread = thread;
+  event->other = other;
+  event->object = object;
+}
+
+int eventtrace_export(char* filename) {
+  FILE* file;
+  event_t* event;
+  unsigned int first, last, i;
+  double cycles_per_us = (double) cyclesPerSecond() / 1000000;
+  unsigned __int64 origin;
+  unsigned __int64 since = 0;
+  int running = -1;
+
+  if (ring == NULL || (file = fopen(filename, "w")) == NULL)
+    return -1;
+
+  last = (unsigned int) ring_head;
+  first = (last > ring_mask + 1) ? last - (ring_mask + 1) : 0;
+  origin = (first == last) ? 0 : ring[first & ring_mask].time;
+
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+	  "\"args\":{\"name\":\"idle\"}}");
+
+  for (i = first; i != last; i++) {
+    event = &ring[i & ring_mask];
+
+    if (event->type == EVENT_SWITCH) {
+      /* close the slice of the thread that was running */
+      if (running == event->thread)
+	fprintf(file, ",\n{\"name\":\"running\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f}", running,
+		(double) (since - origin) / cycles_per_us,
+		(double) (event->time - since) / cycles_per_us);
+      running = event->other;
+      since = event->time;
+      continue;
+    }
+
+    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+	    "\"ts\":%.3f,\"args\":{", event_names[event->type], event->thread,
+	    (double) (event->time - origin) / cycles_per_us);
+    if (event->other != -1)
+      fprintf(file, "\"thread\":%d%s", event->other,
+	      (event->object != NULL) ? "," : "");
+    if (event->object != NULL)
+      fprintf(file, "\"object\":\"%p\"", event->object);
+    fprintf(file, "}}");
+  }
+
+  fprintf(file, "\n]}\n");
+  return (fclose(file) == 0) ? 0 : -1;
+}
@@ -0,0 +1,65 @@
+/*
+ * Binary event tracing of the scheduler.
+ *
+ * Each event is a fixed-size record (timestamp, the thread it happened on,
+ * the other thread involved and an object such as a semaphore) written
+ * into a preallocated ring. Slots are claimed with compare_and_swap, so
+ * recording never blocks and may safely be interrupted by another
+ * recording. When the ring is full the oldest events are overwritten.
+ */
+#ifndef __EVENTTRACE_H__
+#define __EVENTTRACE_H__
+
+#include "machineprimitives.h"
+
+#define EVENT_SWITCH 0     /* thread switched to other */
+#define EVENT_FORK 1       /* thread forked other */
+#define EVENT_EXIT 2       /* thread finished */
+#define EVENT_BLOCK 3      /* thread blocked in semaphore_P on object */
+#define EVENT_WAKEUP 4     /* thread woke other in semaphore_V on object */
+
+typedef struct event {
+  unsigned __int64 time;   /* currentTimeCycles() */
+  int type;
+  int thread;
+  int other;               /* -1 if none */
+  void* object;            /* NULL if none */
+} event_t;
+
+/* whether events are being recorded; test it before calling in */
+extern int eventtrace_enabled;
+
+/*
+ * Record an event if tracing is on. Costs one test when it is off.
+ */
+#define EVENT_TRACE(type, thread, other, object) \
+  do { if (eventtrace_enabled) \
+         eventtrace_record(type, thread, other, object); } while (0)
+
+/*
+ * Start recording into a ring of at least capacity events, discarding
+ * anything recorded before. Return 0 (success) or -1 (failure, which
+ * includes running on more than one virtual processor: the ring is not
+ * safe to share between them).
+ */
+extern int eventtrace_start(int capacity);
+
+/*
+ * Stop recording. The events recorded so far are kept for export.
+ */
+extern void eventtrace_stop();
+
+/*
+ * Append an event to the ring.
+ */
+extern void eventtrace_record(int type, int thread, int other, void* object);
+
+/*
+ * Write the events in the ring, oldest first, to filename in Chrome trace
+ * event JSON (loadable by chrome://tracing and Perfetto). The time each
+ * thread spent running becomes a slice on that thread's track, the other
+ * events instants. Return 0 (success) or -1 (failure).
+ */
+extern int eventtrace_export(char* filename);
+
+#endif __EVENTTRACE_H__
@@ -0,0 +1,118 @@
+/*
+ * Latency histograms; see histogram.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "histogram.h"
+
+/* 2^SUB_BITS buckets per power of two */
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+
+/* enough for every 64 bit value: see bucket_of */
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct histogram {
+  long count;
+  unsigned __int64 max;
+  long buckets[BUCKETS];
+};
+
+/* position of the highest bit set in value, which is not 0 */
+static int highest_bit(unsigned __int64 value) {
+#ifdef __GNUC__
+  return 63 - __builtin_clzll(value);
+#else
+  int bit = 0;
+
+  while (value >>= 1)
+    bit++;
+  return bit;
+#endif
+}
+
+/*
+ * Values below 2 * SUB_BUCKETS have buckets of their own. Above that, a
+ * value is shifted right until only its top SUB_BITS + 1 bits are left;
+ * each shift count has SUB_BUCKETS buckets, after those of smaller ones.
+ */
+static int bucket_of(unsigned __int64 value) {
+  int shift;
+
+  if (value < 2 * SUB_BUCKETS)
+    return (int) value;
+  shift = highest_bit(value) - SUB_BITS;
+  return (shift + 1) * SUB_BUCKETS + (int) (value >> shift) - SUB_BUCKETS;
+}
+
+/* the largest value that falls in a bucket */
+static unsigned __int64 bucket_limit(int bucket) {
+  int shift;
+
+  if (bucket < 2 * SUB_BUCKETS)
+    return bucket;
+  shift = bucket / SUB_BUCKETS - 1;
+  return ((unsigned __int64) (bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+}
+
+histogram_t histogram_new() {
+  histogram_t histogram = (histogram_t) malloc(sizeof(struct histogram));
+
+  if (histogram != NULL)
+    histogram_reset(histogram);
+  return histogram;
+}
+
+void histogram_reset(histogram_t histogram) {
+  memset(histogram, 0, sizeof(struct histogram));
+}
+
+void histogram_record(histogram_t histogram, unsigned __int64 value) {
+  histogram->buckets[bucket_of(value)]++;
+  histogram->count++;
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+long histogram_count(histogram_t histogram) {
+  return histogram->count;
+}
+
+unsigned __int64 histogram_percentile(histogram_t histogram, double percentile) {
+  long rank, seen = 0;
+  unsigned __int64 limit;
+  int i;
+
+  if (histogram->count == 0)
+    return 0;
+  if (percentile >= 100)
+    return histogram->max;
+
+  /* the smallest bucket holding the rank-th smallest value */
+  rank = (long) (percentile / 100 * histogram->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  limit = bucket_limit(i);
+  return (limit < histogram->max) ? limit : histogram->max;
+}
+
+void histogram_print(histogram_t histogram, char* name, char* unit) {
+  printf("%-20s count %8ld  p50 %10llu  p99 %10llu  p999 %10llu  max %10llu %s\n",
+	 name, histogram->count,
+	 histogram_percentile(histogram, 50),
+	 histogram_percentile(histogram, 99),
+	 histogram_percentile(histogram, 99.9),
+	 histogram->max, unit);
+}
+
+void histogram_free(histogram_t histogram) {
+  free(histogram);
+}
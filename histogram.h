@@ -0,0 +1,58 @@
+/*
+ * Latency histograms.
+ *
+ * Values are counted in log-linear buckets: exactly below 64, and above
+ * that in 32 buckets per power of two, so any value is known to within
+ * about 3% whatever its magnitude. Recording costs a few instructions and
+ * no allocation.
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include "defs.h"
+
+/*
+ * histogram_t is a pointer to an internally maintained data structure.
+ */
+typedef struct histogram* histogram_t;
+
+/*
+ * Return an empty histogram. On error should return NULL.
+ */
+extern histogram_t histogram_new();
+
+/*
+ * Forget every value recorded.
+ */
+extern void histogram_reset(histogram_t histogram);
+
+/*
+ * Count one occurrence of value.
+ */
+extern void histogram_record(histogram_t histogram, unsigned __int64 value);
+
+/*
+ * Return the number of values recorded.
+ */
+extern long histogram_count(histogram_t histogram);
+
+/*
+ * Return the value below which percentile percent of the recorded values
+ * fall (e.g. 99.9), rounded up to the end of its bucket; the largest
+ * value for 100, and 0 if nothing has been recorded.
+ */
+extern unsigned __int64 histogram_percentile(histogram_t histogram,
+					     double percentile);
+
+/*
+ * Print the count, p50, p99, p999 and maximum of the histogram on one
+ * line, headed by name and followed by unit.
+ */
+extern void histogram_print(histogram_t histogram, char* name, char* unit);
+
+/*
+ * Free the histogram.
+ */
+extern void histogram_free(histogram_t histogram);
+
+#endif __HISTOGRAM_H__
@@ -47,6 +47,10 @@
 /* a global variable to maintain time */
 long ticks;
 
+/* counted by send_interrupt, which callers serialize on mutex */
+long interrupts_dropped;
+long interrupts_deferred;
+
 typedef struct signal_queue_t signal_queue_t;
 struct signal_queue_t {
   HANDLE threadid;
@@ -133,8 +137,22 @@ static HANDLE system_thread;  /* NT thread for running the minithreads */
 #endif
 static HANDLE return_thread;  /* NT thread for restarting system thread */
 
+/* set by minithread_clock_stop to make the clock and return threads exit */
+static volatile int clock_stopping = 0;
+
 static interrupt_queue_t* interrupt_queue = NULL;
 
+static tick_hook_t tick_hooks[TICK_HOOKS];
+
+/* run every installed tick hook */
+static void call_tick_hooks(void* pc, int taken) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] != NULL)
+      tick_hooks[i](pc, taken);
+}
+
 static int pid;
 
 /* is the main thread ready to be moved back to previous state by the
@@ -295,6 +313,9 @@ DWORD WINAPI interrupt_return_assist(LPVOID ptr) {
     /* wait politely until we are needed */
     WaitOnObject(cleanup);
 
+    if (clock_stopping)
+      break;
+
     if (DEBUG)
       kprintf("IRA:woken up ...\n");
 	
@@ -355,7 +376,6 @@ DWORD WINAPI interrupt_return_assist(LPVOID ptr) {
     free(sq);
   }
 
-  /* never reached */
   return 0;
 }
 
@@ -437,9 +457,16 @@ void send_interrupt(int type, void* arg) {
       }
     } 
      
+    if (type == CLOCK_INTERRUPT_TYPE)
+      call_tick_hooks((void *) EIP, safe_to_proceed);
+
     if (safe_to_proceed == 1)
       break;
     else {
+      if (drop_interrupt == 1)
+	interrupts_dropped++;
+      else
+	interrupts_deferred++;
       ResumeThread(system_thread);
       ReleaseMutex(mutex);
       if (DEBUG) {
@@ -528,7 +555,7 @@ DWORD WINAPI clock_poll(LPVOID arg) {
   timer = CreateWaitableTimer(NULL, TRUE, name);
   assert(timer != NULL);
 
-  for (;;) {
+  while (!clock_stopping) {
     i.QuadPart = -PERIOD*10; /* NT timer values are in hundreds of nanoseconds */
     AbortOnError(SetWaitableTimer(timer, &i, 0, NULL, NULL, FALSE));
 
@@ -538,8 +565,8 @@ DWORD WINAPI clock_poll(LPVOID arg) {
       send_interrupt(CLOCK_INTERRUPT_TYPE, NULL);
     }
   }
+  CloseHandle(timer);
 #endif
-  /* never reached */
   return 0;
 
 }
@@ -559,11 +586,11 @@ void minithread_clock_init(interrupt_handler_t clock_handler)
   char name[64];
  
   if (clock_handler == NULL) {
-    kprintf("Must provide an interrupt handler, interrupts not started.\n");
+    TRACE(TRACE_INTR, TRACE_ERROR, ("Must provide an interrupt handler, interrupts not started.\n"));
     return;
   }
 
-  kprintf("Starting clock interrupts.\n");
+  TRACE(TRACE_INTR, TRACE_INFO, ("Starting clock interrupts.\n"));
 
   /* set values for *start_address and *stop_address */
   start_address = start();
@@ -588,6 +615,7 @@ void minithread_clock_init(interrupt_handler_t clock_handler)
   cleanup = CreateSemaphore(NULL, 0, 10, name);
 
   interrupt_level = DISABLED;
+  clock_stopping = 0;
 
   register_interrupt(CLOCK_INTERRUPT_TYPE, clock_handler, INTERRUPT_DROP);
 
@@ -612,13 +640,71 @@ void minithread_clock_init(interrupt_handler_t clock_handler)
   assert(return_thread != NULL);
 }
 
+/*
+ * Stop the clock started by minithread_clock_init: let the clock and
+ * return threads run down, release their handles, and unregister the
+ * clock handler so that minithread_clock_init may be called again. Must
+ * be called by the system thread; a tick arriving meanwhile finds it
+ * outside minithread code and is dropped.
+ */
+void minithread_clock_stop(void)
+{
+  interrupt_queue_t** link;
+  interrupt_queue_t* clock_entry;
+
+  clock_stopping = 1;
+  WaitOnObject(clock_thread);
+  ReleaseSemaphore(cleanup, 1, NULL);
+  WaitOnObject(return_thread);
+
+  CloseHandle(clock_thread);
+  CloseHandle(return_thread);
+#ifndef WINCE
+  CloseHandle(system_thread);
+#endif
+  CloseHandle(cleanup);
+  CloseHandle(mutex);
+
+  for (link = &interrupt_queue; *link != NULL; link = &(*link)->next)
+    if ((*link)->type == CLOCK_INTERRUPT_TYPE) {
+      clock_entry = *link;
+      *link = clock_entry->next;
+      free(clock_entry);
+      break;
+    }
+
+  TRACE(TRACE_INTR, TRACE_INFO, ("Stopped clock interrupts.\n"));
+}
+
+int minithread_clock_tick_hook(tick_hook_t hook) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == hook)
+      return 0;
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == NULL) {
+      tick_hooks[i] = hook;
+      return 0;
+    }
+  return -1;
+}
+
+void minithread_clock_tick_unhook(tick_hook_t hook) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == hook)
+      tick_hooks[i] = NULL;
+}
+
 int register_interrupt(int type, interrupt_handler_t handler, 
 		       interrupt_property_t property){
   interrupt_queue_t* new_interrupt, *interrupt_info;
   int error=0;
   interrupt_level_t old_interrupt_level;
 
-  kprintf("Registering interrupt of type %d.\n",type);
+  TRACE(TRACE_INTR, TRACE_INFO, ("Registering interrupt of type %d.\n",type));
 
   /* disable interrupts not to have surprises */
   old_interrupt_level = set_interrupt_level(DISABLED);
@@ -631,7 +717,7 @@ int register_interrupt(int type, interrupt_handler_t handler,
   if (interrupt_info != NULL) {
     /* interrupt already exists, return error */
     error=-1;
-    kprintf("An interrupt of this type already registered.\n");
+    TRACE(TRACE_INTR, TRACE_ERROR, ("An interrupt of this type already registered.\n"));
   } else {
     new_interrupt = (interrupt_queue_t*) malloc(sizeof(interrupt_queue_t));
     new_interrupt->type = type;
@@ -35,6 +35,14 @@
 /* a global variable to maintain time */
 extern long ticks;
 
+/*
+ * Interrupts that could not be taken when they arrived, because interrupts
+ * were disabled or the system thread was outside minithread code: dropped
+ * ones are lost, and deferred ones are counted once per failed attempt.
+ */
+extern long interrupts_dropped;
+extern long interrupts_deferred;
+
 typedef void (*interrupt_handler_t)(void* );
 
 /*
@@ -89,4 +97,34 @@ extern interrupt_level_t set_interrupt_level(interrupt_level_t newlevel);
  */
 extern void minithread_clock_init(interrupt_handler_t clock_handler);
 
+/*
+ * minithread_clock_stop stops the clock started by minithread_clock_init.
+ * No tick is delivered after it returns, the host's signal handlers (or
+ * helper threads on NT) are put back the way they were, and the clock
+ * handler is unregistered, so minithread_clock_init may be called again.
+ * Must be called by the host thread which called minithread_clock_init.
+ */
+extern void minithread_clock_stop(void);
+
+/*
+ * minithread_clock_tick_hook installs hook, to be called on every clock
+ * tick whether or not the tick is taken as an interrupt: pc is where the
+ * system thread was stopped, and taken says whether the clock handler is
+ * about to run there. The hook runs in the clock device (a signal handler,
+ * or the clock thread while the system thread is suspended), so it must
+ * not block, allocate or print. Up to TICK_HOOKS hooks may be installed
+ * at once; they are called in the order they were installed. Returns 0,
+ * or -1 if there is no room for another hook. Installing a hook twice
+ * installs it once.
+ *
+ * minithread_clock_tick_unhook removes hook, if it is installed.
+ */
+#define TICK_HOOKS 4
+
+typedef void (*tick_hook_t)(void* pc, int taken);
+
+extern int minithread_clock_tick_hook(tick_hook_t hook);
+
+extern void minithread_clock_tick_unhook(tick_hook_t hook);
+
 #endif  __INTERRUPTS_PUBLIC_H_
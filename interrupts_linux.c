@@ -0,0 +1,480 @@
+/*
+ * Provides a clean, virtualized interface to interrupts.
+ *
+ * Linux port of interrupts.c. The virtual clock is a POSIX timer that
+ * sends SIGALRM to the system thread every PERIOD microseconds. The
+ * signal handler runs on an alternate signal stack and checks, as
+ * send_interrupt does on NT, that interrupts are enabled and that the
+ * system thread was stopped between start() and end(). If so it copies
+ * the interrupted context onto the running minithread's stack and
+ * rewrites the context so that, when the signal returns, the minithread
+ * calls receive_interrupt() on its own stack. interrupt_trampoline
+ * (machineprimitives_x86_64_sysv.S) then resumes the interrupted code by
+ * handing the copy back to rt_sigreturn. No helper threads and no
+ * suspend/get-context/resume round trip are needed.
+ *
+ * YOU SHOULD NOT [NEED TO] MODIFY THIS FILE.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <signal.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "interrupts_private.h"
+#include "machineprimitives.h"
+
+#define EIP(uc) ((uc)->uc_mcontext.gregs[REG_RIP])
+#define ESP(uc) ((uc)->uc_mcontext.gregs[REG_RSP])
+#define REG(uc, r) ((uc)->uc_mcontext.gregs[r])
+
+/* leaf functions may use this much memory below sp without moving sp */
+#define RED_ZONE 128
+
+/* the FPU state is an fxsave image, possibly extended to a full xsave image */
+#define FXSAVE_SIZE 512
+#define FXSAVE_SW_BYTES 464
+#define FP_XSTATE_MAGIC1 0x46505853U
+#define XSAVE_ALIGN 64
+
+#define EFLAGS_DF 0x400
+
+#define SIGNAL_STACK_SIZE (64 * 1024)
+
+/* signal used by send_interrupt to post interrupts from other host threads */
+#define POST_SIGNAL SIGUSR1
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* a global variable to maintain time */
+long ticks;
+
+/* counted by the clock signal handler and by the host threads calling
+   send_interrupt, so only ever updated atomically */
+long interrupts_dropped;
+long interrupts_deferred;
+
+/*
+ * Virtual processor interrupt level (spl).
+ * Are interrupts enabled? A new interrupt will only be taken when interrupts
+ * are enabled.
+ */
+interrupt_level_t interrupt_level;
+
+typedef struct interrupt_queue_t interrupt_queue_t;
+struct interrupt_queue_t {
+  int type;
+  interrupt_handler_t handler;
+  interrupt_property_t property;
+  interrupt_queue_t* next;
+};
+
+/*
+ * Dummy routines to prevent unwanted preemption: when a timer event occurs,
+ * we only preempt if the minithread which is running is at an address between
+ * start() and end(), which enclose all the minithread and user-supplied code.
+ * In this way we protect the C library, which is not "minithread-safe".
+ */
+extern unsigned long start(void);
+extern unsigned long end(void);
+
+/* Code outside these addresses belongs to the operating system */
+static unsigned long start_address;
+static unsigned long end_address;
+
+/* see machineprimitives_x86_64_sysv.S */
+extern void interrupt_trampoline(void);
+
+static pthread_t system_thread;  /* host thread running the minithreads */
+static timer_t clock_timer;      /* virtual clock device */
+
+/* what minithread_clock_init replaced, put back by minithread_clock_stop */
+static stack_t old_signal_stack;
+static struct sigaction old_clock_action;
+static struct sigaction old_post_action;
+
+static interrupt_queue_t* interrupt_queue = NULL;
+
+static tick_hook_t tick_hooks[TICK_HOOKS];
+
+/* run every installed tick hook */
+static void call_tick_hooks(void* pc, int taken) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] != NULL)
+      tick_hooks[i](pc, taken);
+}
+
+/* mailbox through which send_interrupt hands one interrupt at a time to
+   the POST_SIGNAL handler */
+#define POST_EMPTY 0
+#define POST_PENDING 1
+#define POST_DELIVERED 2
+#define POST_REFUSED 3
+
+static pthread_mutex_t post_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int post_state = POST_EMPTY;
+static volatile int post_type;
+static void* volatile post_arg;
+
+interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
+  if (DEBUG)
+    kprintf("Set interrupt level to %d.\n", newlevel);
+  return swap(&interrupt_level, newlevel);
+}
+
+void loopforever() {
+  for(;;)
+    ;
+  /* NOT REACHED */
+  exit(1);
+}
+
+static interrupt_queue_t* find_interrupt(int type) {
+  interrupt_queue_t* interrupt_info = interrupt_queue;
+
+  while (interrupt_info!=NULL && interrupt_info->type!=type)
+    interrupt_info = interrupt_info->next;
+  return interrupt_info;
+}
+
+/* run the user's supplied interrupt handler: called on the interrupted
+   minithread's stack by interrupt_trampoline, which restores the saved
+   context once we return. the handler may switch to other minithreads; the
+   saved context stays on this minithread's stack until it is resumed.
+
+   disables interrupts before returning to the trampoline.
+   */
+void receive_interrupt(ucontext_t* context, int type, void* arg) {
+  interrupt_queue_t* interrupt_info;
+
+  if (DEBUG)
+    kprintf("SYS:Running user interrupt handler, context = %p, arg = %p.\n",
+	   (void *) context, arg);
+
+  interrupt_info = find_interrupt(type);
+  if (interrupt_info == NULL) {
+    /* we couldn't find the interrupt with type "type" so we crash the
+       system.
+    */
+    kprintf("An interrupt of the unregistered type %d was received. Crashing.\n ",
+	   type);
+    exit(-1);
+  } else {
+    /* now, call the appropriate interrupt handler */
+    if (DEBUG)
+      kprintf("SYS:interrupt of type %d.\n", type);
+    if (interrupt_info->handler != NULL)
+      interrupt_info->handler(arg);
+  }
+
+  interrupt_level = DISABLED;
+}
+
+/* size of the FPU image the kernel saved for the interrupted code */
+static size_t fpstate_size(const void* fpstate) {
+  const unsigned int* sw_bytes =
+    (const unsigned int *) ((const char *) fpstate + FXSAVE_SW_BYTES);
+
+  /* magic1 is followed by the extended size, which covers magic2 too */
+  if (sw_bytes[0] == FP_XSTATE_MAGIC1)
+    return sw_bytes[1];
+  return FXSAVE_SIZE;
+}
+
+/*
+ * Try to deliver an interrupt to the system thread, stopped at context uc.
+ * Interrupts are only taken when they are enabled and the thread is
+ * executing minithread or user code; otherwise the caller decides whether
+ * to drop or defer. On success the interrupted context is pushed below the
+ * red zone of the minithread's stack and uc is rewritten so the thread
+ * enters interrupt_trampoline(saved, type, arg) when the signal returns.
+ *
+ * Runs in signal context: no stdio, no malloc.
+ */
+static int deliver_interrupt(ucontext_t* uc, int type, void* arg) {
+  unsigned long sp;
+  ucontext_t* saved;
+  void* fpstate;
+  size_t fpsize;
+
+  if (interrupt_level == DISABLED
+      || ((unsigned long) EIP(uc) < start_address)
+      || ((unsigned long) EIP(uc) > end_address))
+    return 0;
+
+  interrupt_level = DISABLED;
+
+  sp = (unsigned long) ESP(uc) - RED_ZONE;
+
+  fpstate = uc->uc_mcontext.fpregs;
+  if (fpstate != NULL) {
+    fpsize = fpstate_size(fpstate);
+    sp = (sp - fpsize) & ~(unsigned long) (XSAVE_ALIGN - 1);
+    memcpy((void *) sp, fpstate, fpsize);
+    fpstate = (void *) sp;
+  }
+
+  sp = (sp - sizeof(ucontext_t)) & ~(unsigned long) 0xf;
+  saved = (ucontext_t *) sp;
+  memcpy(saved, uc, sizeof(ucontext_t));
+  saved->uc_mcontext.fpregs = fpstate;
+
+  EIP(uc) = (greg_t) interrupt_trampoline;
+  ESP(uc) = (greg_t) saved;
+  REG(uc, REG_RDI) = (greg_t) saved;
+  REG(uc, REG_RSI) = (greg_t) type;
+  REG(uc, REG_RDX) = (greg_t) arg;
+  REG(uc, REG_RBX) = (greg_t) saved;
+  REG(uc, REG_EFL) &= ~EFLAGS_DF;
+
+  return 1;
+}
+
+/* SIGALRM handler: a tick of the virtual clock. clock interrupts which
+   cannot be taken right away are dropped. */
+static void clock_signal(int signo, siginfo_t* info, void* context) {
+  void* pc = (void *) EIP((ucontext_t *) context);
+  int taken = deliver_interrupt((ucontext_t *) context, CLOCK_INTERRUPT_TYPE, NULL);
+
+  if (!taken)
+    __sync_fetch_and_add(&interrupts_dropped, 1);
+  call_tick_hooks(pc, taken);
+}
+
+/* POST_SIGNAL handler: pick up the interrupt posted by send_interrupt */
+static void post_signal(int signo, siginfo_t* info, void* context) {
+  if (post_state != POST_PENDING)
+    return;
+
+  if (deliver_interrupt((ucontext_t *) context, post_type, post_arg))
+    post_state = POST_DELIVERED;
+  else
+    post_state = POST_REFUSED;
+}
+
+/*
+ * Send an interrupt to the system thread from another host thread. If the
+ * system thread is in a non-preemptable state, interrupts of type
+ * INTERRUPT_DROP are dropped and interrupts of type INTERRUPT_DEFER are
+ * retried until they can be delivered. Must not be called by the system
+ * thread itself.
+ */
+void send_interrupt(int type, void* arg) {
+  interrupt_queue_t* interrupt_info = find_interrupt(type);
+
+  if (interrupt_info == NULL) {
+    /*
+     * we couldn't find the interrupt with type "type" so we crash the
+     * system.
+     */
+    kprintf("An interrupt of the unregistered type %d was received.\n",
+	   type);
+    AbortOnCondition(1,"Crashing.");
+  }
+
+  pthread_mutex_lock(&post_mutex);
+  for (;;) {
+    post_type = type;
+    post_arg = arg;
+    post_state = POST_PENDING;
+    pthread_kill(system_thread, POST_SIGNAL);
+
+    while (post_state == POST_PENDING)
+      sched_yield();
+
+    if (post_state == POST_DELIVERED)
+      break;
+    if (interrupt_info->property == INTERRUPT_DROP) {
+      __sync_fetch_and_add(&interrupts_dropped, 1);
+      break;
+    }
+
+    __sync_fetch_and_add(&interrupts_deferred, 1);
+    if (DEBUG)
+      kprintf("Interrupt of type %d deferred.\n", type);
+    sched_yield();
+  }
+  post_state = POST_EMPTY;
+  pthread_mutex_unlock(&post_mutex);
+}
+
+/*
+ * Setup the interval timer and install user interrupt handler.  After this
+ * routine is called, and after you call set_interrupt_level(ENABLED), clock
+ * interrupts will begin to be sent.  They will call the handler
+ * function h specified by the caller.
+ */
+void minithread_clock_init(interrupt_handler_t clock_handler)
+{
+  stack_t signal_stack;
+  struct sigaction action;
+  struct sigevent event;
+  struct itimerspec period;
+
+  if (clock_handler == NULL) {
+    TRACE(TRACE_INTR, TRACE_ERROR, ("Must provide an interrupt handler, interrupts not started.\n"));
+    return;
+  }
+
+  TRACE(TRACE_INTR, TRACE_INFO, ("Starting clock interrupts.\n"));
+
+  /* set values for *start_address and *stop_address */
+  start_address = start();
+  end_address = end();
+
+  if (DEBUG)
+    kprintf("start_address=%lx\tend_address=%lx\n",
+	    start_address, end_address);
+
+  interrupt_level = DISABLED;
+
+  register_interrupt(CLOCK_INTERRUPT_TYPE, clock_handler, INTERRUPT_DROP);
+
+  system_thread = pthread_self();
+
+  /* take signals on a stack of their own, so that the kernel's signal frame
+     never lands on (and overflows) a minithread stack */
+  signal_stack.ss_sp = malloc(SIGNAL_STACK_SIZE);
+  AbortOnCondition(signal_stack.ss_sp == NULL, "No memory for signal stack.");
+  signal_stack.ss_size = SIGNAL_STACK_SIZE;
+  signal_stack.ss_flags = 0;
+  AbortOnError(sigaltstack(&signal_stack, &old_signal_stack));
+
+  memset(&action, 0, sizeof(action));
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaddset(&action.sa_mask, SIGALRM);
+  sigaddset(&action.sa_mask, POST_SIGNAL);
+  action.sa_sigaction = clock_signal;
+  AbortOnError(sigaction(SIGALRM, &action, &old_clock_action));
+  action.sa_sigaction = post_signal;
+  AbortOnError(sigaction(POST_SIGNAL, &action, &old_post_action));
+
+  /* aim the ticks at this host thread, whatever other threads exist */
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGALRM;
+  event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+  AbortOnError(timer_create(CLOCK_MONOTONIC, &event, &clock_timer));
+
+  period.it_interval.tv_sec = PERIOD / SECOND;
+  period.it_interval.tv_nsec = (PERIOD % SECOND) * 1000;
+  period.it_value = period.it_interval;
+  AbortOnError(timer_settime(clock_timer, 0, &period, NULL));
+}
+
+/*
+ * Stop the clock started by minithread_clock_init: delete the timer, throw
+ * away any tick still pending, put back the signal handlers and signal
+ * stack that were there before, and unregister the clock handler so that
+ * minithread_clock_init may be called again. Must be called by the system
+ * thread.
+ */
+void minithread_clock_stop(void)
+{
+  sigset_t signals, old_signals;
+  struct sigaction ignore;
+  stack_t signal_stack;
+  interrupt_queue_t** link;
+  interrupt_queue_t* clock_entry;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGALRM);
+  sigaddset(&signals, POST_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+  AbortOnError(timer_delete(clock_timer));
+
+  /* ignoring a signal discards it if it is pending */
+  memset(&ignore, 0, sizeof(ignore));
+  ignore.sa_handler = SIG_IGN;
+  sigemptyset(&ignore.sa_mask);
+  AbortOnError(sigaction(SIGALRM, &ignore, NULL));
+  AbortOnError(sigaction(SIGALRM, &old_clock_action, NULL));
+  AbortOnError(sigaction(POST_SIGNAL, &old_post_action, NULL));
+
+  AbortOnError(sigaltstack(&old_signal_stack, &signal_stack));
+  free(signal_stack.ss_sp);
+
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  for (link = &interrupt_queue; *link != NULL; link = &(*link)->next)
+    if ((*link)->type == CLOCK_INTERRUPT_TYPE) {
+      clock_entry = *link;
+      *link = clock_entry->next;
+      free(clock_entry);
+      break;
+    }
+
+  TRACE(TRACE_INTR, TRACE_INFO, ("Stopped clock interrupts.\n"));
+}
+
+int minithread_clock_tick_hook(tick_hook_t hook) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == hook)
+      return 0;
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == NULL) {
+      tick_hooks[i] = hook;
+      return 0;
+    }
+  return -1;
+}
+
+void minithread_clock_tick_unhook(tick_hook_t hook) {
+  int i;
+
+  for (i = 0; i < TICK_HOOKS; i++)
+    if (tick_hooks[i] == hook)
+      tick_hooks[i] = NULL;
+}
+
+int register_interrupt(int type, interrupt_handler_t handler,
+		       interrupt_property_t property){
+  interrupt_queue_t* new_interrupt, *interrupt_info;
+  int error=0;
+  interrupt_level_t old_interrupt_level;
+
+  TRACE(TRACE_INTR, TRACE_INFO, ("Registering interrupt of type %d.\n",type));
+
+  /* disable interrupts not to have surprises */
+  old_interrupt_level = set_interrupt_level(DISABLED);
+
+  /* look for an interrupt of the desired type */
+  interrupt_info = find_interrupt(type);
+
+  if (interrupt_info != NULL) {
+    /* interrupt already exists, return error */
+    error=-1;
+    TRACE(TRACE_INTR, TRACE_ERROR, ("An interrupt of this type already registered.\n"));
+  } else {
+    new_interrupt = (interrupt_queue_t*) malloc(sizeof(interrupt_queue_t));
+    new_interrupt->type = type;
+    new_interrupt->handler = handler;
+    new_interrupt->property = property;
+
+    /* insert it in the queue */
+    new_interrupt->next = interrupt_queue;
+    interrupt_queue = new_interrupt;
+  }
+
+  /* put interrupts in their previous state */
+  (void)set_interrupt_level(old_interrupt_level);
+
+  return error;
+}
@@ -0,0 +1,236 @@
+/*
+ * Buffered logging; see klog.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "defs.h"
+#include "interrupts.h"
+#include "minithread.h"
+#include "synch.h"
+#include "klog.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* a thread whose buffer is fuller than this wakes the logger itself */
+#define KLOG_HIGH_WATER (KLOG_BUFFER_SIZE * 3 / 4)
+
+/* orders the data of a buffer against its indices */
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BARRIER() _ReadWriteBarrier()
+#else
+#define BARRIER() __sync_synchronize()
+#endif
+
+/*
+ * Ring buffer of one thread. head and tail count every byte ever written
+ * and read: head only moves forward by the thread, tail by the logger.
+ * closed is set once the thread is gone; the logger frees the buffer
+ * after writing out what is left in it.
+ */
+typedef struct klog_buffer {
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  volatile int closed;
+  struct klog_buffer* next;
+  char data[KLOG_BUFFER_SIZE];
+} klog_buffer_t;
+
+/* every buffer, chained through next; with several processors disabling
+   interrupts does not keep the others out, so the list has a lock too */
+static klog_buffer_t* buffers = NULL;
+static tas_lock_t buffers_lock = 0;
+
+static int log_fd = -1;
+static semaphore_t logger_wakeup;
+static volatile int logger_waiting;
+static volatile int pending;
+static volatile long dropped;
+
+/* wake the logger if it is waiting for work, once however many try */
+static void logger_wake() {
+  if (logger_waiting && swap((int *) &logger_waiting, 0))
+    semaphore_V(logger_wakeup);
+}
+
+/* write out what buffer holds; return -1 if nothing could be written */
+static int buffer_drain(klog_buffer_t* buffer) {
+  unsigned int head = buffer->head;
+  unsigned int tail = buffer->tail;
+  unsigned int start;
+  unsigned int length;
+  int written;
+
+  BARRIER();
+  while (tail != head) {
+    start = tail & (KLOG_BUFFER_SIZE - 1);
+    length = head - tail;
+    if (start + length > KLOG_BUFFER_SIZE)
+      length = KLOG_BUFFER_SIZE - start;
+    written = (int) write(log_fd, buffer->data + start, length);
+    if (written <= 0)
+      return -1;
+    tail += written;
+  }
+  BARRIER();
+  buffer->tail = tail;
+  return 0;
+}
+
+/* body of the logger minithread */
+static int logger_proc(arg_t arg) {
+  klog_buffer_t** link;
+  klog_buffer_t* buffer;
+  interrupt_level_t level;
+
+  for (;;) {
+    level = set_interrupt_level(DISABLED);
+    if (!pending) {
+      logger_waiting = 1;
+      set_interrupt_level(level);
+      semaphore_P(logger_wakeup);
+      level = set_interrupt_level(DISABLED);
+    }
+    pending = 0;
+    set_interrupt_level(level);
+
+    for (link = &buffers; (buffer = *link) != NULL; ) {
+      if (buffer_drain(buffer) == 0 && buffer->closed) {
+	level = set_interrupt_level(DISABLED);
+	while (atomic_test_and_set(&buffers_lock))
+	  processor_relax();
+	/* buffers may have been put in front of it meanwhile */
+	while (*link != buffer)
+	  link = &(*link)->next;
+	*link = buffer->next;
+	atomic_clear(&buffers_lock);
+	set_interrupt_level(level);
+	free(buffer);
+      }
+      else
+	link = &buffer->next;
+    }
+  }
+  return 0;
+}
+
+/* at exit: write out whatever is still buffered, directly */
+static void klog_exit() {
+  klog_buffer_t* buffer;
+
+  set_interrupt_level(DISABLED);
+  for (buffer = buffers; buffer != NULL; buffer = buffer->next)
+    buffer_drain(buffer);
+}
+
+int klog_start(int fd) {
+  minithread_t logger;
+
+  logger_wakeup = semaphore_create();
+  if (logger_wakeup == NULL)
+    return -1;
+  semaphore_initialize(logger_wakeup, 0);
+  semaphore_set_name(logger_wakeup, "klog");
+  log_fd = fd;
+  logger = minithread_fork(logger_proc, NULL);
+  if (logger == NULL) {
+    log_fd = -1;
+    return -1;
+  }
+  /* the logger never exits, so a run to completion must not wait for it */
+  minithread_daemon(logger);
+  atexit(klog_exit);
+  return 0;
+}
+
+void klog_printf(char* format, ...) {
+  minithread_t self = minithread_self();
+  klog_buffer_t* buffer;
+  char line[KLOG_LINE_MAX];
+  interrupt_level_t level;
+  unsigned int head;
+  unsigned int start;
+  int length;
+  int i;
+  va_list args;
+
+  va_start(args, format);
+  if (log_fd == -1 || self == NULL) {
+    vprintf(format, args);
+    va_end(args);
+    return;
+  }
+  length = vsnprintf(line, KLOG_LINE_MAX, format, args);
+  va_end(args);
+  if (length < 0)
+    return;
+  if (length >= KLOG_LINE_MAX)
+    length = KLOG_LINE_MAX - 1;
+
+  /* the scheduler may log on behalf of the next thread while switching,
+     so the buffer is only ever written with interrupts disabled */
+  level = set_interrupt_level(DISABLED);
+  buffer = (klog_buffer_t*) minithread_get_log_buffer(self);
+  if (buffer == NULL) {
+    buffer = (klog_buffer_t*) malloc(sizeof(klog_buffer_t));
+    if (buffer == NULL) {
+      dropped++;
+      set_interrupt_level(level);
+      return;
+    }
+    buffer->head = 0;
+    buffer->tail = 0;
+    buffer->closed = 0;
+    while (atomic_test_and_set(&buffers_lock))
+      processor_relax();
+    buffer->next = buffers;
+    buffers = buffer;
+    atomic_clear(&buffers_lock);
+    minithread_set_log_buffer(self, buffer);
+  }
+
+  head = buffer->head;
+  if (head + length - buffer->tail > KLOG_BUFFER_SIZE) {
+    dropped++;
+    logger_wake();
+    set_interrupt_level(level);
+    return;
+  }
+  for (i = 0; i < length; i++) {
+    start = (head + i) & (KLOG_BUFFER_SIZE - 1);
+    buffer->data[start] = line[i];
+  }
+  BARRIER();
+  buffer->head = head + length;
+  pending = 1;
+  if (buffer->head - buffer->tail > KLOG_HIGH_WATER)
+    logger_wake();
+  set_interrupt_level(level);
+}
+
+void klog_flush() {
+  interrupt_level_t level = set_interrupt_level(DISABLED);
+
+  logger_wake();
+  set_interrupt_level(level);
+}
+
+long klog_dropped() {
+  return dropped;
+}
+
+void klog_idle() {
+  if (pending)
+    logger_wake();
+}
+
+void klog_thread_exit(void* buffer) {
+  ((klog_buffer_t*) buffer)->closed = 1;
+  pending = 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Buffered logging.
+ *
+ * klog_printf formats a message into a ring buffer of the calling
+ * minithread and returns: it never does I/O, so it never blocks the
+ * caller or keeps it outside the preemptible code for long. A logger
+ * minithread writes the buffers out to a file descriptor in batches. It is
+ * woken by the idle thread, so it only runs when nothing else wants to,
+ * or earlier by a thread whose buffer is filling up.
+ *
+ * Each buffer has one writer (its thread) and one reader (the logger),
+ * so neither ever waits for the other. A message that does not fit in
+ * its thread's buffer is dropped and counted. Messages of one thread stay
+ * in order; messages of different threads may be interleaved by line.
+ */
+#ifndef __KLOG_H__
+#define __KLOG_H__
+
+#include "defs.h"
+
+/* bytes buffered per thread (a power of two) */
+#define KLOG_BUFFER_SIZE 4096
+
+/* longest message; longer ones are cut short */
+#define KLOG_LINE_MAX 256
+
+/*
+ * Fork the logger minithread, which writes messages to fd. Must be called
+ * from a minithread. Before it is called, klog_printf prints directly.
+ * Whatever is still buffered when the process exits is written out then.
+ * Return 0 (success) or -1 (failure).
+ */
+extern int klog_start(int fd);
+
+/*
+ * Log a message, printf style.
+ */
+extern void klog_printf(char* format, ...);
+
+/*
+ * Wake the logger, to have everything logged so far written out as soon
+ * as the calling thread gives up the processor.
+ */
+extern void klog_flush();
+
+/*
+ * Number of messages dropped because their thread's buffer was full.
+ */
+extern long klog_dropped();
+
+/*
+ * Called by the scheduler: klog_idle when the idle thread runs, and
+ * klog_thread_exit with the buffer of a thread being reclaimed.
+ */
+extern void klog_idle();
+
+extern void klog_thread_exit(void* buffer);
+
+#endif __KLOG_H__
@@ -0,0 +1,243 @@
+/* loadgen.c
+
+   Open-loop load generator for a service modeled on retailTest.c: a
+   generator thread appends requests to a shared queue and clerk threads
+   take them off and serve them. Unlike the producers of retailTest.c, the
+   generator never waits for the service: requests arrive at the offered
+   rate, with Poisson (exponentially distributed) inter-arrival times drawn
+   from random.c, however far behind the clerks fall.
+
+   Latency is measured from the moment a request was due to arrive to the
+   moment a clerk finishes it, so time the generator itself spends waiting
+   for the processor counts as queueing delay, as it would for a real
+   client. For each offered load the run reports the throughput achieved
+   and the latency percentiles; the knee is where the tail starts to climb.
+
+   usage: loadgen [-f csv|json] [-r rate,...] [-d seconds] [-c clerks]
+                  [-s service_us] [-S seed] [-o file]
+
+   Rates are requests per second. Each request costs a clerk service_us
+   microseconds of processor time, so the service saturates at about
+   1000000 / service_us requests per second.
+*/
+
+#include "minithread.h"
+#include "synch.h"
+#include "queue.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_RATES 32
+
+/* random.c */
+extern void sgenrand(unsigned long seed);
+extern double genrand();
+
+typedef struct {
+  unsigned __int64 due;   /* when it was to arrive, in cycles */
+} request_t;
+
+double rates[MAX_RATES] = {5000, 10000, 20000, 30000, 40000, 45000, 50000, 60000};
+int rate_count = 8;
+double duration = 1;
+int clerks = 4;
+int service_us = 20;
+unsigned long seed = 4357;
+int json = 0;
+FILE* out;
+
+semaphore_t full;
+semaphore_t mutex;
+queue_t requests;
+histogram_t latencies;
+long completed;
+unsigned __int64 service_cycles;
+
+/* busy for the service time: the clerk's share of the work */
+void serve(request_t* request) {
+  unsigned __int64 end = currentTimeCycles() + service_cycles;
+
+  while (currentTimeCycles() < end)
+    ;
+}
+
+int clerk(int* arg) {
+  request_t* request;
+
+  for (;;) {
+    semaphore_P(full);
+    semaphore_P(mutex);
+    queue_dequeue(requests, (void **) &request);
+    semaphore_V(mutex);
+
+    serve(request);
+    histogram_record(latencies, currentTimeCycles() - request->due);
+    completed++;
+    free(request);
+  }
+  return 0;
+}
+
+/* exponentially distributed inter-arrival time, in cycles */
+double interarrival(double rate) {
+  double u;
+
+  /* genrand() is uniform on [0, 1] */
+  do
+    u = genrand();
+  while (u >= 1.0);
+  return -log(1.0 - u) / rate * cyclesPerSecond();
+}
+
+void offer(double rate, int first) {
+  double cycles_per_us = cyclesPerSecond() / 1e6;
+  unsigned __int64 begin, end, finished;
+  double due;
+  request_t* request;
+  long issued = 0;
+
+  histogram_reset(latencies);
+  completed = 0;
+
+  begin = currentTimeCycles();
+  end = begin + (unsigned __int64) (duration * cyclesPerSecond());
+  due = (double) begin + interarrival(rate);
+
+  while (due < end) {
+    /* let the clerks run until the next request is due */
+    while (currentTimeCycles() < (unsigned __int64) due)
+      minithread_yield();
+
+    request = (request_t *) malloc(sizeof(request_t));
+    if (request == NULL) {
+      fprintf(stderr, "loadgen: out of memory\n");
+      exit(1);
+    }
+    request->due = (unsigned __int64) due;
+    semaphore_P(mutex);
+    queue_append(requests, request);
+    semaphore_V(mutex);
+    semaphore_V(full);
+    issued++;
+
+    due += interarrival(rate);
+  }
+  while (completed < issued)
+    minithread_yield();
+  finished = currentTimeCycles();
+
+  if (json)
+    fprintf(out, "%s\n    {\"offered_per_sec\": %.0f, \"achieved_per_sec\": %.0f, "
+	    "\"requests\": %ld, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+	    "\"p999_us\": %.1f, \"max_us\": %.1f}",
+	    first ? "" : ",", rate, issued * cyclesPerSecond() / (double) (finished - begin),
+	    issued, histogram_percentile(latencies, 50) / cycles_per_us,
+	    histogram_percentile(latencies, 90) / cycles_per_us,
+	    histogram_percentile(latencies, 99) / cycles_per_us,
+	    histogram_percentile(latencies, 99.9) / cycles_per_us,
+	    histogram_percentile(latencies, 100) / cycles_per_us);
+  else
+    fprintf(out, "%.0f,%.0f,%ld,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+	    rate, issued * cyclesPerSecond() / (double) (finished - begin),
+	    issued, histogram_percentile(latencies, 50) / cycles_per_us,
+	    histogram_percentile(latencies, 90) / cycles_per_us,
+	    histogram_percentile(latencies, 99) / cycles_per_us,
+	    histogram_percentile(latencies, 99.9) / cycles_per_us,
+	    histogram_percentile(latencies, 100) / cycles_per_us);
+  fflush(out);
+}
+
+int run(int* arg) {
+  int i;
+
+  full = semaphore_create();
+  semaphore_initialize(full, 0);
+  mutex = semaphore_create();
+  semaphore_initialize(mutex, 1);
+  requests = queue_new();
+  latencies = histogram_new();
+  if (full == NULL || mutex == NULL || requests == NULL || latencies == NULL) {
+    fprintf(stderr, "loadgen: out of memory\n");
+    exit(1);
+  }
+  service_cycles = (unsigned __int64) service_us * cyclesPerSecond() / 1000000;
+  sgenrand(seed);
+
+  /* the clerks wait for requests forever, so the run does not wait for them */
+  for (i = 0; i < clerks; i++)
+    minithread_daemon(minithread_fork(clerk, NULL));
+
+  if (json)
+    fprintf(out, "{\"clerks\": %d, \"service_us\": %d, \"seconds\": %.2f, \"loads\": [",
+	    clerks, service_us, duration);
+  else
+    fprintf(out, "offered_per_sec,achieved_per_sec,requests,p50_us,p90_us,p99_us,p999_us,max_us\n");
+
+  for (i = 0; i < rate_count; i++)
+    offer(rates[i], i == 0);
+
+  if (json)
+    fprintf(out, "\n]}\n");
+  return 0;
+}
+
+void usage(char* program) {
+  fprintf(stderr, "usage: %s [-f csv|json] [-r rate,...] [-d seconds] [-c clerks] "
+	  "[-s service_us] [-S seed] [-o file]\n", program);
+  exit(1);
+}
+
+/* parse a comma separated list of rates */
+void parse_rates(char* list, char* program) {
+  char* rate;
+
+  rate_count = 0;
+  for (rate = strtok(list, ","); rate != NULL; rate = strtok(NULL, ",")) {
+    if (rate_count == MAX_RATES || atof(rate) <= 0)
+      usage(program);
+    rates[rate_count++] = atof(rate);
+  }
+  if (rate_count == 0)
+    usage(program);
+}
+
+int main(int argc, char** argv) {
+  int i;
+
+  out = stderr;
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || i + 1 == argc)
+      usage(argv[0]);
+    if (strcmp(argv[i], "-f") == 0)
+      json = (strcmp(argv[++i], "json") == 0);
+    else if (strcmp(argv[i], "-r") == 0)
+      parse_rates(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "-d") == 0)
+      duration = atof(argv[++i]);
+    else if (strcmp(argv[i], "-c") == 0)
+      clerks = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-s") == 0)
+      service_us = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-S") == 0)
+      seed = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-o") == 0) {
+      out = fopen(argv[++i], "w");
+      if (out == NULL) {
+	perror(argv[i]);
+	return 1;
+      }
+    }
+    else
+      usage(argv[0]);
+  }
+  if (duration <= 0 || clerks <= 0 || service_us < 0 || seed == 0)
+    usage(argv[0]);
+
+  minithread_system_run(run, NULL, NULL);
+  fclose(out);
+  return 0;
+}
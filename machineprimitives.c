@@ -8,9 +8,15 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include "defs.h"
 #include "minithread.h"
 #include "machineprimitives.h"
+#include "interrupts.h"
 
 /*
  * Used to initialize a thread's stack for the first context switch
@@ -20,15 +26,18 @@
 typedef struct initial_stack_state *initial_stack_state_t;
 struct initial_stack_state 
 {
-  void *body_proc;            /* v1 or ebx */
-  void *body_arg;             /* v2 or edi */
-  void *finally_proc;         /* v3 or esi */
-  void *finally_arg;          /* v4 or ebp */
+  void *body_proc;            /* v1, ebx or r15 */
+  void *body_arg;             /* v2, edi or r14 */
+  void *finally_proc;         /* v3, esi or r13 */
+  void *finally_arg;          /* v4, ebp or r12 */
 #ifdef WINCE
   int   v5;
   int   v6;
   int   sl;
   int   fp;
+#elif defined(__x86_64__) && !defined(_WIN64)
+  void *rbx;                  /* remaining System V callee-saved registers */
+  void *rbp;
 #endif
   void *root_proc;            /* left on stack */
 };
@@ -37,25 +46,348 @@ struct initial_stack_state
 #define STACKSIZE               (256 * 1024)
 #define STACKALIGN              0xf
 
+/*
+ * Default watermarks of the stack cache: once more than STACK_CACHE_HIGH
+ * retired stacks of one size are cached, they are trimmed back to
+ * STACK_CACHE_LOW. Stacks of up to STACK_CACHE_CLASSES distinct sizes
+ * are cached at a time; stacks of other sizes are released right away.
+ *
+ * The watermarks are high enough for a fan-out of a few thousand threads
+ * to be forked again without mapping a stack. Stacks cached beyond
+ * STACK_CACHE_LOW give their memory back to the system (see
+ * stack_discard), so what the cache holds above that is address space.
+ */
+#define STACK_CACHE_LOW         256
+#define STACK_CACHE_HIGH        4096
+#define STACK_CACHE_CLASSES     8
+
+/*
+ * Retired stacks are kept on free lists, one per stack size, and handed
+ * to the next new thread asking for that size. The link lives in the
+ * topmost word of the stack, which every thread has already touched, so
+ * caching a stack never commits one of its untouched pages.
+ */
+typedef struct cached_stack *cached_stack_t;
+struct cached_stack
+{
+  cached_stack_t next;
+};
+
+typedef struct stack_class *stack_class_t;
+struct stack_class
+{
+  int size;                   /* usable bytes of each stack, 0 if unused */
+  int cached;
+  cached_stack_t stacks;
+};
+
+static struct stack_class stack_cache[STACK_CACHE_CLASSES];
+static int stack_cache_low = STACK_CACHE_LOW;
+static int stack_cache_high = STACK_CACHE_HIGH;
+static stack_cache_stats_t stack_cache_stats;
+
+/*
+ * Disabling interrupts keeps the clock away from the cache, but with
+ * several virtual processors (see minithread_processors) other host
+ * threads use it too, so it is also guarded by a lock.
+ */
+static tas_lock_t stack_cache_lock = 0;
+
+static interrupt_level_t
+stack_cache_acquire()
+{
+    interrupt_level_t l = set_interrupt_level(DISABLED);
+
+    while (atomic_test_and_set(&stack_cache_lock))
+      processor_relax();
+    return l;
+}
+
+static void
+stack_cache_release(interrupt_level_t l)
+{
+    atomic_clear(&stack_cache_lock);
+    set_interrupt_level(l);
+}
+
+static int page_size = 0;
+
+/*
+ * When stack painting is on, new stacks are filled with STACK_PAINT_BYTE
+ * so that minithread_stack_used can later find the deepest byte written.
+ */
+#define STACK_PAINT_BYTE        0xa5
+
+static int stack_paint = 0;
+
+#define STACK_LINK(base, size) \
+  ((cached_stack_t) ((char *) (base) + (size) - sizeof(struct cached_stack)))
+
+/*
+ * Round a requested stack size up to whole pages; 0 selects STACKSIZE.
+ */
+static int
+stack_round_size(int size)
+{
+    if (page_size == 0) {
+#ifdef _WIN32
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      page_size = info.dwPageSize;
+#else
+      page_size = (int) sysconf(_SC_PAGESIZE);
+#endif
+    }
+    if (size <= 0)
+      size = STACKSIZE;
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/*
+ * Reserve size bytes of stack with an inaccessible guard page below them,
+ * so that an overflow faults instead of corrupting the neighbouring
+ * memory. On Linux pages are only backed by memory once the thread
+ * touches them. NT grows committed stacks on guard page faults only for
+ * the stacks of its own threads, so there the whole stack is committed
+ * now. Returns the lowest usable address, or NULL.
+ *
+ * Every guarded stack is two kernel mappings; on Linux, running more than
+ * about 30000 threads at once needs a larger vm.max_map_count.
+ */
+static stack_pointer_t
+stack_map(int size)
+{
+    char *region;
+#ifdef _WIN32
+    DWORD old_protection;
+
+    region = (char *) VirtualAlloc(NULL, size + page_size,
+				   MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (region == NULL)
+      return NULL;
+    VirtualProtect(region, page_size, PAGE_NOACCESS, &old_protection);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+    region = (char *) mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+			   flags, -1, 0);
+    if (region == (char *) MAP_FAILED)
+      return NULL;
+    mprotect(region, page_size, PROT_NONE);
+#endif
+    return (stack_pointer_t) (region + page_size);
+}
+
+/*
+ * Reserve n guarded stacks of size bytes with one mapping and store their
+ * lowest usable addresses in stackbases. Each stack can be released on
+ * its own with stack_unmap. Returns 0, or -1 if there is no memory.
+ *
+ * NT can only release a reservation as a whole, so there the stacks are
+ * reserved one at a time.
+ */
+static int
+stack_map_slab(int n, int size, stack_pointer_t *stackbases)
+{
+    int i;
+#ifdef _WIN32
+    for (i = 0; i < n; i++) {
+      stackbases[i] = stack_map(size);
+      if (stackbases[i] == NULL) {
+	while (i-- > 0)
+	  stack_unmap(stackbases[i], size);
+	return -1;
+      }
+    }
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    size_t stride = (size_t) size + page_size;
+    char *region;
+
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+    region = (char *) mmap(NULL, stride * n, PROT_READ | PROT_WRITE,
+			   flags, -1, 0);
+    if (region == (char *) MAP_FAILED)
+      return -1;
+    for (i = 0; i < n; i++) {
+      mprotect(region + stride * i, page_size, PROT_NONE);
+      stackbases[i] = (stack_pointer_t) (region + stride * i + page_size);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Give the memory behind a stack back to the system but keep the stack,
+ * whose pages read as zero (or anything, on NT) when next touched. The
+ * top page, which holds the cache link, is kept.
+ */
+static void
+stack_discard(stack_pointer_t stackbase, int size)
+{
+#ifdef _WIN32
+    VirtualAlloc(stackbase, size - page_size, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise(stackbase, size - page_size, MADV_DONTNEED);
+#endif
+}
+
+static void
+stack_unmap(stack_pointer_t stackbase, int size)
+{
+    char *region = (char *) stackbase - page_size;
+#ifdef _WIN32
+    VirtualFree(region, 0, MEM_RELEASE);
+#else
+    munmap(region, size + page_size);
+#endif
+}
+
+/*
+ * Paint a freshly allocated stack if painting is on, and return its
+ * initial stack top.
+ */
+static stack_pointer_t
+stack_prepare(stack_pointer_t stackbase, int size)
+{
+    if (stack_paint)
+      memset(stackbase, STACK_PAINT_BYTE, size);
+
+    if (STACK_GROWS_DOWN)
+      /* Stacks grow down, but the mapping grows up. Compensate and align
+	 (turn off the low bits by anding with ~STACKALIGN). */
+      return (stack_pointer_t) ((size_t)((char*)stackbase + size - 1) & ~STACKALIGN);
+    else {
+      /* Word align (turn off low 2 bits by anding with ~3) */
+      return (stack_pointer_t)(((size_t)stackbase + 3)&~STACKALIGN);
+    }
+}
+
+/*
+ * Find the cache class for stacks of the given size, claiming an empty
+ * class if there is none yet. Interrupts must be disabled.
+ */
+static stack_class_t
+stack_cache_class(int size)
+{
+    stack_class_t free_class = NULL;
+    int i;
+
+    for (i = 0; i < STACK_CACHE_CLASSES; i++) {
+      if (stack_cache[i].size == size)
+	return &stack_cache[i];
+      if (free_class == NULL && stack_cache[i].cached == 0)
+	free_class = &stack_cache[i];
+    }
+    if (free_class != NULL)
+      free_class->size = size;
+    return free_class;
+}
+
+/*
+ * Give cached stacks of a class back to the system until at most keep are
+ * left. Interrupts must be disabled.
+ */
+static void
+stack_cache_trim(stack_class_t class, int keep)
+{
+    cached_stack_t link;
+
+    while (class->cached > keep) {
+      link = class->stacks;
+      class->stacks = link->next;
+      class->cached--;
+      stack_cache_stats.cached--;
+      stack_cache_stats.releases++;
+      stack_unmap((char *) link + sizeof(struct cached_stack) - class->size,
+		  class->size);
+    }
+}
+
 /*
  * Allocate a new stack.
  */
 void
 minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stacktop)
 {
-    *stackbase = (stack_pointer_t) malloc(STACKSIZE);
+    minithread_allocate_stack_ex(stackbase, stacktop, 0);
+}
+
+/*
+ * Allocate a new stack of stack_size bytes (STACKSIZE if 0).
+ */
+void
+minithread_allocate_stack_ex(stack_pointer_t *stackbase,
+			     stack_pointer_t *stacktop, int stack_size)
+{
+    interrupt_level_t l = stack_cache_acquire();
+    stack_class_t class;
+    int size = stack_round_size(stack_size);
+
+    class = stack_cache_class(size);
+    if (class != NULL && class->stacks != NULL) {
+      *stackbase = (stack_pointer_t)
+	((char *) class->stacks + sizeof(struct cached_stack) - size);
+      class->stacks = class->stacks->next;
+      class->cached--;
+      stack_cache_stats.cached--;
+      stack_cache_stats.hits++;
+    } else {
+      *stackbase = stack_map(size);
+      stack_cache_stats.misses++;
+    }
+    stack_cache_release(l);
+
     if (!*stackbase)  {
 	return;
     }
 
-    if (STACK_GROWS_DOWN)
-      /* Stacks grow down, but malloc grows up. Compensate and word align
-	 (turn off low 2 bits by anding with ~3). */
-      *stacktop = (stack_pointer_t) ((long)((char*)*stackbase + STACKSIZE - 1) & ~STACKALIGN);
-    else {
-      /* Word align (turn off low 2 bits by anding with ~3) */
-      *stacktop = (stack_pointer_t)(((long)*stackbase + 3)&~STACKALIGN);
+    *stacktop = stack_prepare(*stackbase, size);
+}
+
+/*
+ * Allocate n stacks of stack_size bytes (STACKSIZE if 0) at once. Cached
+ * stacks are used first; the rest are carved out of a single mapping, each
+ * with its own guard page, and can later be freed one by one. Returns 0,
+ * or -1 if there is no memory, in which case nothing is allocated.
+ */
+int
+minithread_allocate_stacks(int n, stack_pointer_t *stackbases,
+			   stack_pointer_t *stacktops, int stack_size)
+{
+    interrupt_level_t l;
+    stack_class_t class;
+    int size = stack_round_size(stack_size);
+    int i = 0, j;
+
+    l = stack_cache_acquire();
+    class = stack_cache_class(size);
+    while (class != NULL && class->stacks != NULL && i < n) {
+      stackbases[i++] = (stack_pointer_t)
+	((char *) class->stacks + sizeof(struct cached_stack) - size);
+      class->stacks = class->stacks->next;
+      class->cached--;
+      stack_cache_stats.cached--;
+      stack_cache_stats.hits++;
+    }
+    if (i < n && stack_map_slab(n - i, size, stackbases + i) != 0) {
+      /* put back what we took from the cache */
+      stack_cache_release(l);
+      for (j = 0; j < i; j++)
+	minithread_free_stack_ex(stackbases[j], size);
+      return -1;
     }
+    stack_cache_stats.misses += n - i;
+    stack_cache_release(l);
+
+    for (i = 0; i < n; i++)
+      stacktops[i] = stack_prepare(stackbases[i], size);
+    return 0;
 }
 
 /* 
@@ -66,7 +398,101 @@ minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stacktop)
 void
 minithread_free_stack(stack_pointer_t stackbase)
 {
-    free(stackbase);
+    minithread_free_stack_ex(stackbase, 0);
+}
+
+/*
+ * Free a stack allocated by minithread_allocate_stack_ex with the same
+ * stack_size.
+ */
+void
+minithread_free_stack_ex(stack_pointer_t stackbase, int stack_size)
+{
+    interrupt_level_t l;
+    stack_class_t class;
+    cached_stack_t link;
+    int size = stack_round_size(stack_size);
+
+    if (stackbase == NULL)
+      return;
+
+    l = stack_cache_acquire();
+    class = stack_cache_class(size);
+    if (class == NULL || stack_cache_high == 0) {
+      stack_cache_stats.releases++;
+      stack_unmap(stackbase, size);
+    } else {
+      link = STACK_LINK(stackbase, size);
+      link->next = class->stacks;
+      class->stacks = link;
+      class->cached++;
+      stack_cache_stats.cached++;
+      if (class->cached > stack_cache_high)
+	stack_cache_trim(class, stack_cache_low);
+      else if (class->cached > stack_cache_low && size > page_size)
+	stack_discard(stackbase, size);
+    }
+    stack_cache_release(l);
+}
+
+/*
+ * Turn stack painting on or off for stacks allocated from now on.
+ */
+void
+minithread_stack_paint(int enabled)
+{
+    stack_paint = enabled;
+}
+
+/*
+ * Measure how much of a painted stack has been written to: scan up from
+ * the bottom for the first word that no longer holds the paint.
+ */
+int
+minithread_stack_used(stack_pointer_t stackbase, int stack_size)
+{
+    size_t paint = ((size_t) -1 / 0xff) * STACK_PAINT_BYTE;
+    int size = stack_round_size(stack_size);
+    size_t *word = (size_t *) stackbase;
+    size_t *limit = (size_t *) ((char *) stackbase + size);
+
+    while (word < limit && *word == paint)
+      word++;
+    return (int) ((char *) limit - (char *) word);
+}
+
+/*
+ * Set the watermarks of the stack cache.
+ */
+int
+minithread_stack_cache_configure(int low_watermark, int high_watermark)
+{
+    interrupt_level_t l;
+    int i;
+
+    if (low_watermark < 0 || high_watermark < low_watermark)
+      return -1;
+
+    l = stack_cache_acquire();
+    stack_cache_low = low_watermark;
+    stack_cache_high = high_watermark;
+    for (i = 0; i < STACK_CACHE_CLASSES; i++)
+      if (stack_cache[i].cached > stack_cache_high)
+	stack_cache_trim(&stack_cache[i], stack_cache_low);
+    stack_cache_release(l);
+    return 0;
+}
+
+/*
+ * Report the stack cache counters.
+ */
+void
+minithread_stack_cache_get_stats(stack_cache_stats_t *stats)
+{
+    interrupt_level_t l = stack_cache_acquire();
+
+    *stats = stack_cache_stats;
+    stack_cache_release(l);
 }
 
 /*
@@ -104,6 +530,10 @@ minithread_initialize_stack(
     ss->body_arg = (void *) body_arg;
     ss->finally_proc = (void *) finally_proc;
     ss->finally_arg = (void *) finally_arg;
+#if defined(__x86_64__) && !defined(_WIN64)
+    ss->rbx = NULL;
+    ss->rbp = NULL;             /* terminates frame-pointer backtraces */
+#endif
 
     ss->root_proc = (void *) minithread_root;
 }
@@ -10,7 +10,9 @@
  */
 #ifndef __MINITHREAD_PUBLIC_H_
 #define __MINITHREAD_PUBLIC_H_
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include "defs.h"
 
 typedef void *stack_pointer_t;
@@ -46,6 +48,82 @@ extern void minithread_allocate_stack(stack_pointer_t *stackbase,
  */
 extern void minithread_free_stack(stack_pointer_t stackbase);
 
+/*
+ * minithread_allocate_stack_ex(stack_pointer_t *stackbase,
+ *                              stack_pointer_t *stacktop, int stack_size)
+ *	Like minithread_allocate_stack, but the stack holds stack_size bytes
+ *	(rounded up to whole pages; 0 selects the default size). Stacks are
+ *	mapped with a guard page below stackbase, so overflowing the stack
+ *	faults. On Linux they are reserved address space, and only the pages
+ *	a thread actually touches consume memory; on NT every page is
+ *	committed (charged against the commit limit) up front. *stackbase is
+ *	NULL if the stack cannot be allocated.
+ *
+ * minithread_free_stack_ex(stack_pointer_t stackbase, int stack_size)
+ *	Free a stack allocated by minithread_allocate_stack_ex, passing the
+ *	same stack_size.
+ */
+extern void minithread_allocate_stack_ex(stack_pointer_t *stackbase,
+					 stack_pointer_t *stacktop,
+					 int stack_size);
+
+extern void minithread_free_stack_ex(stack_pointer_t stackbase,
+				     int stack_size);
+
+/*
+ * minithread_allocate_stacks(int n, stack_pointer_t *stackbases,
+ *                            stack_pointer_t *stacktops, int stack_size)
+ *	Allocate n stacks of stack_size bytes at once, filling in the n
+ *	entries of stackbases and stacktops. Stacks missing from the cache
+ *	come from a single reservation. Each stack is freed on its own with
+ *	minithread_free_stack_ex. Returns 0, or -1 (nothing allocated).
+ */
+extern int minithread_allocate_stacks(int n, stack_pointer_t *stackbases,
+				      stack_pointer_t *stacktops,
+				      int stack_size);
+
+/*
+ * minithread_stack_paint(int enabled)
+ *	While enabled, every stack allocated is filled with a known pattern
+ *	(which commits all of its pages).
+ *
+ * int minithread_stack_used(stack_pointer_t stackbase, int stack_size)
+ *	For a painted stack, return the number of bytes below the top of
+ *	the stack that have been written since it was allocated, i.e. the
+ *	peak depth reached by the thread running on it.
+ */
+extern void minithread_stack_paint(int enabled);
+
+extern int minithread_stack_used(stack_pointer_t stackbase, int stack_size);
+
+/*
+ * Freed stacks are cached, separately for each stack size, and reused by
+ * minithread_allocate_stack rather than returned to the system. When the
+ * cache holds more than high_watermark stacks of one size they are
+ * trimmed back to low_watermark. Stacks cached beyond low_watermark keep
+ * their address space but give their memory back to the system. The
+ * defaults, 256 and 4096, let a fan-out of a few thousand threads be
+ * forked again without mapping new stacks.
+ *
+ * minithread_stack_cache_configure(int low_watermark, int high_watermark)
+ *	Set the watermarks. Passing 0, 0 disables caching. Returns 0, or -1
+ *	if the watermarks are invalid (negative, or low above high).
+ *
+ * minithread_stack_cache_get_stats(stack_cache_stats_t *stats)
+ *	Copy the cache counters into *stats.
+ */
+typedef struct stack_cache_stats {
+  int cached;          /* stacks currently held by the cache */
+  long hits;           /* allocations served from the cache */
+  long misses;         /* allocations that had to map a new stack */
+  long releases;       /* stacks returned to the system */
+} stack_cache_stats_t;
+
+extern int minithread_stack_cache_configure(int low_watermark,
+					    int high_watermark);
+
+extern void minithread_stack_cache_get_stats(stack_cache_stats_t *stats);
+
 /*
  * 	Initialize the stackframe pointed to by *stacktop so that
  *	the thread running off of *stacktop will invoke:
@@ -109,6 +187,68 @@ extern int swap(int* x, int newval);
  */
 extern int compare_and_swap(int* x, int oldval, int newval);
 
+/*
+ * swap and compare_and_swap on pointers.
+ */
+extern void* swap_pointer(void** x, void* newval);
+
+extern void* compare_and_swap_pointer(void** x, void* oldval, void* newval);
+
+/*
+ *	Hint to the processor that the caller is spinning on a lock or flag.
+ */
+#ifdef _WIN32
+#define processor_relax() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define processor_relax() __builtin_ia32_pause()
+#else
+#define processor_relax() __sync_synchronize()
+#endif
+
+/*
+ *	Wait once more for a lock or flag held by another host thread, where
+ *	spins counts the waits so far, this one included. Every
+ *	SPINS_BEFORE_YIELD waits the host is let run its other threads
+ *	rather than the processor relaxed, so that a waiter never keeps the
+ *	holder, preempted by the host, off the processor for long.
+ */
+#define SPINS_BEFORE_YIELD 64
+
+#define spin_wait(spins) \
+  do { \
+    if ((spins) % SPINS_BEFORE_YIELD == 0) \
+      host_thread_yield(); \
+    else \
+      processor_relax(); \
+  } while (0)
+
+/* HOST THREADS */
+
+/*
+ * THREAD_LOCAL declares a variable with one instance per host thread.
+ */
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/*
+ * Run proc(arg) on a new host thread, which ends when proc returns.
+ * Returns 0, or -1 if the thread could not be created.
+ */
+extern int host_thread_start(proc_t proc, arg_t arg);
+
+/*
+ * Let the host run another of its threads, if any is waiting.
+ */
+extern void host_thread_yield();
+
+/*
+ * Number of processors the host has.
+ */
+extern int host_processor_count();
+
 /*
  *  Returns the current time in milliseconds
  *    To be used only for timings - your OS should keep track of its
@@ -116,5 +256,14 @@ extern int compare_and_swap(int* x, int oldval, int newval);
  */
 unsigned __int64 currentTimeMillis();
 
+/*
+ *  Returns the value of a fast, monotonic counter (the time stamp
+ *    counter where there is one), for timing short intervals cheaply.
+ *    cyclesPerSecond() gives its rate.
+ */
+unsigned __int64 currentTimeCycles();
+
+unsigned __int64 cyclesPerSecond();
+
 
 #endif __MINITHREAD_PUBLIC_H_
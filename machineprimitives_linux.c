@@ -0,0 +1,143 @@
+/*
+ * Minithreads x86-64/Linux Machine Dependent Code
+ *
+ * Counterpart of machineprimitives_x86.c for Linux hosts; the assembly
+ * primitives live in machineprimitives_x86_64_sysv.S.
+ *
+ * You should not need to modify this file.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>     // included for currentTimeMillis
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "minithread.h"
+#include "interrupts.h"
+
+unsigned __int64 currentTimeMillis() {
+  struct timespec now;
+  unsigned __int64 lt = 0;
+  clock_gettime(CLOCK_REALTIME, &now);
+  lt = now.tv_sec;
+  lt = lt*1000;
+  lt = lt+now.tv_nsec/1000000;
+  return lt;
+}
+
+/* nanoseconds on the monotonic clock */
+static unsigned __int64 monotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned __int64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+unsigned __int64 currentTimeCycles() {
+  return __builtin_ia32_rdtsc();
+}
+
+/* measured once against the monotonic clock, over CALIBRATION_NANOS */
+#define CALIBRATION_NANOS 10000000
+
+unsigned __int64 cyclesPerSecond() {
+  static unsigned __int64 rate = 0;
+  unsigned __int64 start_nanos, start_cycles, nanos;
+
+  if (rate == 0) {
+    start_nanos = monotonicNanos();
+    start_cycles = currentTimeCycles();
+    do
+      nanos = monotonicNanos() - start_nanos;
+    while (nanos < CALIBRATION_NANOS);
+    rate = (currentTimeCycles() - start_cycles) * 1000000000 / nanos;
+  }
+  return rate;
+}
+
+#else
+
+unsigned __int64 currentTimeCycles() {
+  return monotonicNanos();
+}
+
+unsigned __int64 cyclesPerSecond() {
+  return 1000000000;
+}
+
+#endif
+
+/*
+ * atomic_test_and_set, swap, compare_and_swap, minithread_root and
+ * minithread_switch: see machineprimitives_x86_64_sysv.S.
+ */
+
+/*
+ * atomic_clear
+ *
+ */
+
+void atomic_clear(tas_lock_t *l) {
+	*l = 0;
+}
+
+/*
+ * swap_pointer, compare_and_swap_pointer
+ *
+ */
+
+void* swap_pointer(void** x, void* newval) {
+  /* __sync_lock_test_and_set is only an acquire barrier */
+  __sync_synchronize();
+  return __sync_lock_test_and_set(x, newval);
+}
+
+void* compare_and_swap_pointer(void** x, void* oldval, void* newval) {
+  return __sync_val_compare_and_swap(x, oldval, newval);
+}
+
+/*
+ * Host threads
+ */
+typedef struct host_thread_args {
+  proc_t proc;
+  arg_t arg;
+} host_thread_args_t;
+
+static void* host_thread_root(void* arg) {
+  host_thread_args_t args = *(host_thread_args_t *) arg;
+
+  free(arg);
+  args.proc(args.arg);
+  return NULL;
+}
+
+int host_thread_start(proc_t proc, arg_t arg) {
+  host_thread_args_t* args = (host_thread_args_t *) malloc(sizeof(host_thread_args_t));
+  pthread_t thread;
+
+  if (args == NULL)
+    return -1;
+  args->proc = proc;
+  args->arg = arg;
+  if (pthread_create(&thread, NULL, host_thread_root, args) != 0) {
+    free(args);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void host_thread_yield() {
+  sched_yield();
+}
+
+int host_processor_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return (count > 0) ? (int) count : 1;
+}
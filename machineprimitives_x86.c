@@ -23,6 +23,18 @@ unsigned __int64 currentTimeMillis() {
   return lt;
 }
 
+unsigned __int64 currentTimeCycles() {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+unsigned __int64 cyclesPerSecond() {
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  return frequency.QuadPart;
+}
+
 /* atomic_test_and_set - using the native compare and exchange on the 
    Intel x86; returns 0 if we set, 1 if not (think: l == 1 => locked,
    and we return the old value, so we get 0 if we managed to lock l).
@@ -54,6 +66,19 @@ void atomic_clear(tas_lock_t *l) {
 	*l = 0;	
 }
 
+/*
+ * swap_pointer, compare_and_swap_pointer
+ *
+ */
+
+void* swap_pointer(void** x, void* newval) {
+  return InterlockedExchangePointer(x, newval);
+}
+
+void* compare_and_swap_pointer(void** x, void* oldval, void* newval) {
+  return InterlockedCompareExchangePointer(x, newval, oldval);
+}
+
 
 /*
  * minithread_root
@@ -68,3 +93,49 @@ extern int minithread_root();
  */
 extern void minithread_switch(stack_pointer_t *old_thread_sp_ptr,
                       stack_pointer_t *new_thread_sp_ptr);
+
+
+/*
+ * Host threads
+ */
+typedef struct host_thread_args {
+  proc_t proc;
+  arg_t arg;
+} host_thread_args_t;
+
+static DWORD WINAPI host_thread_root(LPVOID arg) {
+  host_thread_args_t args = *(host_thread_args_t *) arg;
+
+  free(arg);
+  args.proc(args.arg);
+  return 0;
+}
+
+int host_thread_start(proc_t proc, arg_t arg) {
+  host_thread_args_t* args = (host_thread_args_t *) malloc(sizeof(host_thread_args_t));
+  HANDLE thread;
+  DWORD id;
+
+  if (args == NULL)
+    return -1;
+  args->proc = proc;
+  args->arg = arg;
+  thread = CreateThread(NULL, 0, host_thread_root, args, 0, &id);
+  if (thread == NULL) {
+    free(args);
+    return -1;
+  }
+  CloseHandle(thread);
+  return 0;
+}
+
+void host_thread_yield() {
+  SwitchToThread();
+}
+
+int host_processor_count() {
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return (int) info.dwNumberOfProcessors;
+}
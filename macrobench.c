@@ -0,0 +1,608 @@
+/* macrobench.c
+
+   Workload benchmarks: the demo programs, without their printing and with
+   their sizes as parameters, run at a range of thread counts.
+
+     sieve   the sieve.c pipeline: a source, a filter thread for each of
+             the first threads-2 primes and the sink. The filters are
+             forked up front rather than as their primes come through,
+             which would cost a number of switches growing with the
+             square of the thread count. Items are the numbers fed in,
+             from 2 on; each is dropped by the filter of its smallest
+             prime factor, so the work depends on the items and not on
+             how deep the pipeline is.
+     buffer  the buffer.c bounded buffer, as threads/2 independent
+             producer/consumer pairs each with a buffer of its own.
+     retail  the retailTest.c shop: threads/2 producers and threads/2
+             consumers sharing one queue guarded by empty, full and mutex.
+
+   Each run reports the threads asked for and the threads the workload
+   actually ran, items per second, context switches per item and
+   rss_growth_kb: how far the resident set size rose above what it was
+   when the run began. That is the memory the run itself added; the
+   control blocks, queue nodes and stacks the runtime keeps pooled from
+   earlier runs are already resident, so a run that reuses them adds
+   little. Where the peak cannot be reset (anywhere but Linux) it is how
+   far the run raised the peak of the whole process, which understates
+   runs smaller than an earlier one. Above SHARED_THRESHOLD threads
+   (or with -s shared) the threads run on the shared stack: a mapped stack
+   per thread would run into the system's limit on mappings long before a
+   million threads.
+
+   With -p the threads run on that many virtual processors (see
+   minithread_processors; 0 means one per host processor). Shared stacks
+   are not available there, so every thread gets a stack of its own.
+
+   Results go to stderr (or the -o file) as CSV or JSON.
+
+   usage: macrobench [-f csv|json] [-t threads,...] [-i items] [-p processors]
+                     [-s auto|dedicated|shared] [-o file] [workload ...]
+*/
+
+#include "minithread.h"
+#include "synch.h"
+#include "queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BUFFER_SIZE 16
+
+/* the retailTest.c shop shelf */
+#define SHELF_SIZE 15
+
+/* thread counts above which "-s auto" uses the shared stack */
+#define SHARED_THRESHOLD 10000
+
+#define MAX_THREAD_COUNTS 32
+
+#define STACKS_AUTO 0
+#define STACKS_DEDICATED 1
+#define STACKS_SHARED 2
+
+typedef minithread_t (*fork_proc_t)(proc_t, arg_t);
+
+/*
+ * A workload runs with about threads threads, moving about items items,
+ * and returns the items moved. *actual is set to the threads it used.
+ */
+typedef long (*workload_proc_t)(int threads, long items, int* actual);
+
+typedef struct {
+  char* name;
+  workload_proc_t proc;
+  long items;          /* default items */
+} workload_t;
+
+int thread_counts[MAX_THREAD_COUNTS] = {10, 100, 1000, 10000, 100000, 1000000};
+int thread_count_count = 6;
+long items = 0;
+int stacks = STACKS_AUTO;
+int virtual_processors = 1;
+int json = 0;
+FILE* out;
+
+semaphore_t done;
+fork_proc_t fork_thread;
+
+/* the share of total items that worker i of n handles */
+long share(long total, int n, int i) {
+  return total / n + (i < total % n);
+}
+
+void fork_or_die(proc_t proc, arg_t arg) {
+  if (fork_thread(proc, arg) == NULL) {
+    fprintf(stderr, "macrobench: fork failed\n");
+    exit(1);
+  }
+}
+
+semaphore_t semaphore_new(int count) {
+  semaphore_t sem = semaphore_create();
+
+  if (sem == NULL) {
+    fprintf(stderr, "macrobench: out of memory\n");
+    exit(1);
+  }
+  semaphore_initialize(sem, count);
+  return sem;
+}
+
+/*
+ * sieve
+ */
+typedef struct {
+  int value;
+  semaphore_t produce;
+  semaphore_t consume;
+} channel_t;
+
+typedef struct {
+  channel_t* left;
+  channel_t* right;
+  int prime;
+} filter_t;
+
+int sieve_max;
+
+channel_t* channel_new() {
+  channel_t* c = (channel_t *) malloc(sizeof(channel_t));
+
+  if (c == NULL) {
+    fprintf(stderr, "macrobench: out of memory\n");
+    exit(1);
+  }
+  c->produce = semaphore_new(0);
+  c->consume = semaphore_new(0);
+  return c;
+}
+
+void channel_free(channel_t* c) {
+  semaphore_destroy(c->produce);
+  semaphore_destroy(c->consume);
+  free(c);
+}
+
+int sieve_source(int* arg) {
+  channel_t* c = (channel_t *) arg;
+  int i;
+
+  for (i = 2; i <= sieve_max; i++) {
+    c->value = i;
+    semaphore_V(c->consume);
+    semaphore_P(c->produce);
+  }
+  c->value = -1;
+  semaphore_V(c->consume);
+  return 0;
+}
+
+int sieve_filter(int* arg) {
+  filter_t* f = (filter_t *) arg;
+  int value;
+
+  for (;;) {
+    semaphore_P(f->left->consume);
+    value = f->left->value;
+    semaphore_V(f->left->produce);
+    if ((value == -1) || (value % f->prime != 0)) {
+      f->right->value = value;
+      semaphore_V(f->right->consume);
+      semaphore_P(f->right->produce);
+    }
+    if (value == -1)
+      break;
+  }
+  /* nothing upstream uses the left channel once -1 has gone through */
+  channel_free(f->left);
+  free(f);
+  return 0;
+}
+
+/* the first n primes, by marking composites up to a bound on the nth */
+int* first_primes(int n) {
+  int max = (n < 6) ? 13 : (int) (n * (log((double) n) + log(log((double) n)))) + 1;
+  char* composite = (char *) calloc(max + 1, 1);
+  int* primes = (int *) malloc(n * sizeof(int));
+  int found = 0;
+  long i, j;
+
+  if (composite == NULL || primes == NULL) {
+    fprintf(stderr, "macrobench: out of memory\n");
+    exit(1);
+  }
+  for (i = 2; found < n; i++)
+    if (!composite[i]) {
+      primes[found++] = (int) i;
+      for (j = i * i; j <= max; j += i)
+	composite[j] = 1;
+    }
+  free(composite);
+  return primes;
+}
+
+/* the calling thread is the sink */
+long sieve(int threads, long count, int* actual) {
+  /* a source, the sink and the filters make up the threads */
+  int filters = (threads > 3) ? threads - 2 : 1;
+  int* primes = first_primes(filters);
+  channel_t* first = channel_new();
+  channel_t* p = first;
+  filter_t* f;
+  int value;
+  int i;
+
+  for (i = 0; i < filters; i++) {
+    f = (filter_t *) malloc(sizeof(filter_t));
+    if (f == NULL) {
+      fprintf(stderr, "macrobench: out of memory\n");
+      exit(1);
+    }
+    f->left = p;
+    f->prime = primes[i];
+    p = channel_new();
+    f->right = p;
+    fork_or_die(sieve_filter, (int *) f);
+  }
+  free(primes);
+
+  sieve_max = (int) count + 1;
+  fork_or_die(sieve_source, (int *) first);
+
+  /* what reaches the sink has no factor among the filters' primes */
+  do {
+    semaphore_P(p->consume);
+    value = p->value;
+    semaphore_V(p->produce);
+  } while (value != -1);
+  channel_free(p);
+
+  *actual = filters + 2;
+  return count;
+}
+
+/*
+ * buffer
+ */
+typedef struct {
+  int buffer[BUFFER_SIZE];
+  int head;
+  int tail;
+  long count;
+  semaphore_t empty;
+  semaphore_t full;
+} pair_t;
+
+int buffer_consumer(int* arg) {
+  pair_t* p = (pair_t *) arg;
+  long i;
+
+  for (i = 0; i < p->count; i++) {
+    semaphore_P(p->empty);
+    p->tail = (p->tail + 1) % BUFFER_SIZE;
+    semaphore_V(p->full);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int buffer_producer(int* arg) {
+  pair_t* p = (pair_t *) arg;
+  long i;
+
+  for (i = 0; i < p->count; i++) {
+    semaphore_P(p->full);
+    p->buffer[p->head] = (int) i;
+    p->head = (p->head + 1) % BUFFER_SIZE;
+    semaphore_V(p->empty);
+  }
+  return 0;
+}
+
+long buffer(int threads, long count, int* actual) {
+  int pairs = (threads / 2 > 0) ? threads / 2 : 1;
+  pair_t* p = (pair_t *) malloc(pairs * sizeof(pair_t));
+  int i;
+
+  /* at least one item per pair */
+  if (count < pairs)
+    count = pairs;
+  if (p == NULL) {
+    fprintf(stderr, "macrobench: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < pairs; i++) {
+    p[i].head = p[i].tail = 0;
+    p[i].count = share(count, pairs, i);
+    p[i].empty = semaphore_new(0);
+    p[i].full = semaphore_new(BUFFER_SIZE);
+    fork_or_die(buffer_producer, (int *) &p[i]);
+    fork_or_die(buffer_consumer, (int *) &p[i]);
+  }
+  for (i = 0; i < pairs; i++)
+    semaphore_P(done);
+
+  for (i = 0; i < pairs; i++) {
+    semaphore_destroy(p[i].empty);
+    semaphore_destroy(p[i].full);
+  }
+  free(p);
+  *actual = 2 * pairs;
+  return count;
+}
+
+/*
+ * retail
+ */
+semaphore_t shelf_empty;
+semaphore_t shelf_full;
+semaphore_t shelf_mutex;
+queue_t shelf;
+
+int retail_consumer(int* arg) {
+  long count = *(long *) arg;
+  void* phone;
+  long i;
+
+  for (i = 0; i < count; i++) {
+    semaphore_P(shelf_full);
+    semaphore_P(shelf_mutex);
+    queue_dequeue(shelf, &phone);
+    free(phone);
+    semaphore_V(shelf_mutex);
+    semaphore_V(shelf_empty);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int retail_producer(int* arg) {
+  long count = *(long *) arg;
+  int* phone;
+  long i;
+
+  for (i = 0; i < count; i++) {
+    semaphore_P(shelf_empty);
+    semaphore_P(shelf_mutex);
+    phone = (int *) malloc(sizeof(int));
+    *phone = (int) i;
+    queue_append(shelf, phone);
+    semaphore_V(shelf_mutex);
+    semaphore_V(shelf_full);
+  }
+  return 0;
+}
+
+long retail(int threads, long count, int* actual) {
+  int workers = (threads / 2 > 0) ? threads / 2 : 1;
+  long* counts = (long *) malloc(workers * sizeof(long));
+  int i;
+
+  /* at least one phone per producer */
+  if (count < workers)
+    count = workers;
+  if (counts == NULL) {
+    fprintf(stderr, "macrobench: out of memory\n");
+    exit(1);
+  }
+  shelf_empty = semaphore_new(SHELF_SIZE);
+  shelf_full = semaphore_new(0);
+  shelf_mutex = semaphore_new(1);
+  shelf = queue_new();
+
+  /* producer i and consumer i handle the same number of phones */
+  for (i = 0; i < workers; i++) {
+    counts[i] = share(count, workers, i);
+    fork_or_die(retail_producer, (int *) &counts[i]);
+    fork_or_die(retail_consumer, (int *) &counts[i]);
+  }
+  for (i = 0; i < workers; i++)
+    semaphore_P(done);
+
+  semaphore_destroy(shelf_empty);
+  semaphore_destroy(shelf_full);
+  semaphore_destroy(shelf_mutex);
+  queue_free(shelf);
+  free(counts);
+  *actual = 2 * workers;
+  return count;
+}
+
+workload_t workloads[] = {
+  {"sieve", sieve, 20000},
+  {"buffer", buffer, 1000000},
+  {"retail", retail, 1000000}
+};
+
+#define WORKLOADS ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+/*
+ * Peak resident set size. On Linux the peak can be reset between runs,
+ * down to the resident set size at the time; elsewhere it is the peak of
+ * the whole process so far.
+ */
+#if defined(__linux__)
+
+void peak_rss_reset() {
+  FILE* file = fopen("/proc/self/clear_refs", "w");
+
+  if (file != NULL) {
+    fputs("5", file);
+    fclose(file);
+  }
+}
+
+long peak_rss_kb() {
+  FILE* file = fopen("/proc/self/status", "r");
+  char line[128];
+  long kb = -1;
+
+  if (file == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), file) != NULL)
+    if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+      break;
+  fclose(file);
+  return kb;
+}
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+
+void peak_rss_reset() {
+}
+
+long peak_rss_kb() {
+  PROCESS_MEMORY_COUNTERS counters;
+
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return -1;
+  return (long) (counters.PeakWorkingSetSize / 1024);
+}
+
+#else
+
+#include <sys/resource.h>
+
+void peak_rss_reset() {
+}
+
+long peak_rss_kb() {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) == -1)
+    return -1;
+  return usage.ru_maxrss;
+}
+
+#endif
+
+void measure(workload_t* workload, int threads, int first) {
+  long count = (items > 0) ? items : workload->items;
+  int shared = virtual_processors == 1 && ((stacks == STACKS_SHARED)
+    || (stacks == STACKS_AUTO && threads > SHARED_THRESHOLD));
+  unsigned __int64 switches;
+  unsigned __int64 begin;
+  double seconds;
+  long moved;
+  long rss_base;
+  long rss_growth = -1;
+  int actual;
+
+  fork_thread = shared ? minithread_fork_shared : minithread_fork;
+
+  peak_rss_reset();
+  rss_base = peak_rss_kb();
+  switches = minithread_switch_count();
+  begin = currentTimeCycles();
+  moved = workload->proc(threads, count, &actual);
+  seconds = (double) (currentTimeCycles() - begin) / cyclesPerSecond();
+  switches = minithread_switch_count() - switches;
+  /* the kernel's counts are loose by a page or so, and may even go back */
+  if (rss_base != -1) {
+    rss_growth = peak_rss_kb() - rss_base;
+    if (rss_growth < 0)
+      rss_growth = 0;
+  }
+
+  if (json)
+    fprintf(out, "%s\n    {\"workload\": \"%s\", \"threads\": %d, \"actual_threads\": %d, "
+	    "\"stacks\": \"%s\", \"items\": %ld, \"seconds\": %.4f, \"items_per_sec\": %.0f, "
+	    "\"switches_per_item\": %.2f, \"rss_growth_kb\": %ld}",
+	    first ? "" : ",", workload->name, threads, actual, shared ? "shared" : "dedicated",
+	    moved, seconds, moved / seconds, (double) switches / moved, rss_growth);
+  else
+    fprintf(out, "%s,%d,%d,%s,%ld,%.4f,%.0f,%.2f,%ld\n",
+	    workload->name, threads, actual, shared ? "shared" : "dedicated",
+	    moved, seconds, moved / seconds, (double) switches / moved, rss_growth);
+  fflush(out);
+}
+
+char** selected;
+int selected_count;
+
+int run(int* arg) {
+  int first = 1;
+  int i, j;
+
+  done = semaphore_new(0);
+
+  if (json)
+    fprintf(out, "{\"processors\": %d, \"runs\": [", virtual_processors);
+  else
+    fprintf(out, "workload,threads,actual_threads,stacks,items,seconds,items_per_sec,switches_per_item,rss_growth_kb\n");
+
+  for (i = 0; i < WORKLOADS; i++) {
+    if (selected_count > 0) {
+      for (j = 0; j < selected_count; j++)
+	if (strcmp(selected[j], workloads[i].name) == 0)
+	  break;
+      if (j == selected_count)
+	continue;
+    }
+    for (j = 0; j < thread_count_count; j++) {
+      measure(&workloads[i], thread_counts[j], first);
+      first = 0;
+    }
+  }
+
+  if (json)
+    fprintf(out, "\n]}\n");
+  return 0;
+}
+
+void usage(char* program) {
+  int i;
+
+  fprintf(stderr, "usage: %s [-f csv|json] [-t threads,...] [-i items] "
+	  "[-p processors] [-s auto|dedicated|shared] [-o file] [workload ...]\nworkloads:", program);
+  for (i = 0; i < WORKLOADS; i++)
+    fprintf(stderr, " %s", workloads[i].name);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+/* parse a comma separated list of thread counts */
+void parse_thread_counts(char* list, char* program) {
+  char* count;
+
+  thread_count_count = 0;
+  for (count = strtok(list, ","); count != NULL; count = strtok(NULL, ",")) {
+    if (thread_count_count == MAX_THREAD_COUNTS || atoi(count) <= 0)
+      usage(program);
+    thread_counts[thread_count_count++] = atoi(count);
+  }
+  if (thread_count_count == 0)
+    usage(program);
+}
+
+int main(int argc, char** argv) {
+  int i;
+
+  out = stderr;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (i + 1 == argc)
+      usage(argv[0]);
+    if (strcmp(argv[i], "-f") == 0)
+      json = (strcmp(argv[++i], "json") == 0);
+    else if (strcmp(argv[i], "-t") == 0)
+      parse_thread_counts(argv[++i], argv[0]);
+    else if (strcmp(argv[i], "-i") == 0)
+      items = atol(argv[++i]);
+    else if (strcmp(argv[i], "-p") == 0)
+      virtual_processors = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-s") == 0) {
+      i++;
+      if (strcmp(argv[i], "auto") == 0)
+	stacks = STACKS_AUTO;
+      else if (strcmp(argv[i], "dedicated") == 0)
+	stacks = STACKS_DEDICATED;
+      else if (strcmp(argv[i], "shared") == 0)
+	stacks = STACKS_SHARED;
+      else
+	usage(argv[0]);
+    }
+    else if (strcmp(argv[i], "-o") == 0) {
+      out = fopen(argv[++i], "w");
+      if (out == NULL) {
+	perror(argv[i]);
+	return 1;
+      }
+    }
+    else
+      usage(argv[0]);
+  }
+  selected = argv + i;
+  selected_count = argc - i;
+  if (minithread_processors(virtual_processors) == -1)
+    usage(argv[0]);
+
+  minithread_system_run(run, NULL, NULL);
+  fclose(out);
+  return 0;
+}
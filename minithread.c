@@ -7,14 +7,34 @@
  *	NAMING AND TYPING OF THESE PROCEDURES.
  *
  */
+
+/*Scheduler traces go through the buffered log, so they never block a switch*/
+#define TRACE_PRINTF klog_printf
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "minithread.h"
 #include "queue.h"
 #include "synch.h"
+#include "eventtrace.h"
+#include "histogram.h"
+#include "interrupts.h"
+#include "perfcounters.h"
+#include "statspage.h"
+#include "klog.h"
 
 #include <assert.h>
 
+/*Orders the saving of a thread's context against the flag saying it is saved*/
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BARRIER() _ReadWriteBarrier()
+#else
+#define BARRIER() __sync_synchronize()
+#endif
+
 /*
  * A minithread should be defined either in this file or in a private
  * header file.  Minithreads have a stack pointer with to make procedure
@@ -24,32 +44,1139 @@
  */
 
 /*
- * Minithread struct. Contains the stack base and the stack top along with the
- * unique id of the thread.
+ * Scheduling state of a minithread. A thread is on the ready queue of
+ * one of the processors exactly when it is THREAD_RUNNABLE.
+ */
+typedef enum {THREAD_RUNNING, THREAD_RUNNABLE, THREAD_STOPPED, THREAD_DEAD} thread_status_t;
+
+/*
+ * Hardware counter totals of a thread (see perfcounters.h): what it
+ * counted while running, and what the switches into it cost, i.e. from
+ * the read just before the switch away from the previous thread to the
+ * read just after it returned here. A thread's first run does not return
+ * through a switch, so its first switch in is counted as running.
+ */
+typedef struct perf_account {
+	unsigned __int64 run[PERF_COUNTERS];
+	unsigned __int64 switchin[PERF_COUNTERS];
+	long switches;
+} perf_account_t;
+
+/*
+ * A request from a foreign host thread (see minithread_start_from_foreign):
+ * a thread to start, or a thread to fork at proc(arg) if thread is NULL.
+ * The requests to start a thread use the one in its control block; queued
+ * is set while that is on the queue.
+ */
+typedef struct foreign_request {
+	struct foreign_request* next;
+	struct minithread* thread;
+	proc_t proc;
+	arg_t arg;
+	int queued;
+} *foreign_request_t;
+
+/*
+ * Minithread struct. Contains the stack base, the stack top and the stack size
+ * along with the unique id of the thread and its scheduling state. When
+ * tcbonstack is set the struct itself lives at the top of the thread's
+ * stack, just above its first frame. Every live thread is on the
+ * all_threads list, and accounts the time spent in each state in cycles.
+ * oncpu is set while a processor is running the thread, up to the point
+ * where the switch away from it has saved its context. foreign is the
+ * request foreign host threads start it with.
  */
 struct minithread {
 	stack_pointer_t stackbase;
 	stack_pointer_t stacktop;
+	int stacksize;
+	int stackpainted;
+	proc_t proc;
+	arg_t arg;
 	int id;
+	thread_status_t status;
+	int shared;
+	int tcbonstack;
+	char* savedstack;
+	int savedsize;
+	int savedcapacity;
+	struct minithread* next;
+	struct minithread* prevthread;
+	struct minithread* nextthread;
+	unsigned __int64 statechange;
+	unsigned __int64 runcycles;
+	unsigned __int64 runnablecycles;
+	unsigned __int64 blockedcycles;
+	long voluntary;
+	long involuntary;
+	long waits;
+	int woken;
+	perf_account_t perf;
+	void* logbuffer;
+	int daemon;
+	volatile int oncpu;
+	struct foreign_request foreign;
 };
 
-/*The currently executing thread*/
-minithread_t current_thread;
+/*
+ * Stack usage of the threads started at one procedure, recorded as they
+ * are reclaimed while stack profiling is on. Once enough
+ * threads have been measured, tunedsize is the stack size new threads of
+ * that procedure get in STACK_PROFILE_TUNE mode.
+ */
+typedef struct stack_profile {
+	proc_t proc;
+	int threads;
+	int peak;
+	int tunedsize;
+} *stack_profile_t;
+
+/*Number of procedures whose stack usage can be tracked*/
+#define STACK_PROFILES 64
+
+/*Threads measured before a procedure's stack size is tuned*/
+#define STACK_TUNE_SAMPLES 4
+
+/*Tuned stacks get twice the peak usage seen plus this much headroom*/
+#define STACK_TUNE_SLACK 4096
+
+/*
+ * Shared-stack threads (minithread_fork_shared) all execute on one shared
+ * stack. While such a thread is not on the shared stack, the frames it had
+ * there, from its stacktop up to shared_stacktop, are kept in its
+ * savedstack buffer. Frames are only moved when a different shared-stack
+ * thread needs the stack, so switching between a shared-stack thread and
+ * ordinary threads copies nothing.
+ */
+#define SHARED_STACK_SIZE (256 * 1024)
+
+/*Stack of the helper context which moves frames when both sides of a switch use the shared stack*/
+#define COPY_HELPER_STACK_SIZE (16 * 1024)
+
+/*Room for building the initial frame of a shared-stack thread*/
+#define INITIAL_FRAME_WORDS 32
+
+/*
+ * An exiting thread switches straight to the next runnable thread and
+ * leaves itself on the dead list, since its stack is in use until then.
+ * Exiting threads reclaim the dead list once it holds this many threads,
+ * and the idle thread reclaims whatever is on it.
+ */
+#define DEAD_REAP_BATCH 16
+
+/*Control blocks the pool grows by when it runs dry*/
+#define TCB_SLAB_COUNT 64
+
+/*
+ * Virtual processors (see minithread_processors). Each is a host thread
+ * with its own ready queue, current thread and idle thread, which runs on
+ * the host thread's own stack; processor 0 is the host thread that
+ * started the system. A thread made runnable goes on the queue of the
+ * processor that made it so, and a processor with nothing to run steals
+ * from the queues of the others, so threads move between processors. A
+ * processor's lock guards its ready queue; the rest of it is only touched
+ * by the processor itself. With one processor no lock is ever taken.
+ */
+typedef struct processor {
+	int id;
+	tas_lock_t lock;
+	queue_t runqueue;
+	minithread_t current;
+	minithread_t idle;
+	minithread_t switchedfrom;
+	minithread_t dead;
+	int deadcount;
+	unsigned __int64 switches;
+	char padding[64];	/*keeps each processor on cache lines of its own*/
+} processor_t;
+
+/*Threads an idle processor takes from the queue of another at once, at most*/
+#define STEAL_BATCH 16
+
+/*Threads forked for foreign host threads at one switch, at most*/
+#define FOREIGN_FORK_BATCH 32
 
-/*The idle thread (Used for cleanup / Never terminated)*/
-minithread_t idle_thread;
+/*Rounds an idle processor spins finding nothing to run before letting the host run something else*/
+#define IDLE_SPINS 64
+
+/*The virtual processors, how many there are, and whether they are to stop*/
+processor_t processors[MINITHREAD_MAX_PROCESSORS];
+int processor_count = 1;
+volatile int processors_stopping = 0;
+
+/*
+ * The processor the calling host thread is. Other host threads (such as
+ * the NT clock thread) see processor 0. Not static: a thread can resume
+ * on another host thread after any switch, so the compiler must not keep
+ * the value across calls.
+ */
+THREAD_LOCAL processor_t* this_processor = &processors[0];
+
+/*The currently executing thread, the idle thread (which reclaims dead threads and is never terminated),
+  the queue of runnable threads and the exited threads waiting to be reclaimed, all of this processor*/
+#define current_thread (this_processor->current)
+#define idle_thread (this_processor->idle)
+#define runnable_queue (this_processor->runqueue)
+#define dead_threads (this_processor->dead)
+#define dead_count (this_processor->deadcount)
 
 /*Unique thread id generator. Assigned and incremented each time a new thread is spawned*/
 int thread_id_counter;
 
-/*Queue ds representing the currently runnable threads*/
-queue_t runnable_queue;
+/*How long threads sat on the ready queue, and threads made runnable by minithread_start took to run, in ns*/
+histogram_t queue_residency;
+histogram_t wakeup_latency;
+double ns_per_cycle;
+
+/*Whether switches read the hardware counters, and their values at the last read*/
+int perf_counting = 0;
+unsigned __int64 perf_last[PERF_COUNTERS];
+
+/*Counter totals of the threads reclaimed since counting was first turned on*/
+typedef struct perf_record {
+	int id;
+	perf_account_t perf;
+} perf_record_t;
+
+perf_record_t* perf_exited;
+int perf_exited_count;
+int perf_exited_capacity;
+
+/*Whether the clock is running, and whether it is wanted but waiting for processor 0 to start it*/
+int clock_running = 0;
+volatile int clock_pending = 0;
+
+/*The live statistics page, if one is published, and the time and switch count of its last update*/
+statspage_t* stats_page;
+unsigned __int64 stats_page_created;
+unsigned __int64 stats_page_updated;
+unsigned __int64 stats_page_switches;
+
+/*Runaways recorded before further ones are only counted*/
+#define RUNAWAY_RECORDS 64
+
+/*Runaway detection: threshold (0 when off), the current stretches and what has been recorded*/
+int runaway_threshold = 0;
+unsigned __int64 runaway_switches;
+long runaway_running;
+long runaway_disabled;
+minithread_runaway_t* runaway_running_record;
+minithread_runaway_t* runaway_disabled_record;
+minithread_runaway_t runaways[RUNAWAY_RECORDS];
+volatile int runaway_count;
+volatile long runaway_missed;
+
+/*Every live thread, for the statistics snapshot (chained through prevthread/nextthread), and its lock,
+  which also guards the id counter and the daemon count*/
+minithread_t all_threads;
+int thread_count;
+tas_lock_t threads_lock = 0;
+
+/*Live threads marked by minithread_daemon, which minithread_system_run does not wait for*/
+int daemon_count;
+
+/*
+ * Requests from foreign host threads, newest first. They push onto it
+ * with compare and swap; the scheduler takes the whole list at once with
+ * swap. As no request is taken off on its own, a push cannot be fooled by
+ * a head that was taken off and pushed back on in between.
+ */
+foreign_request_t volatile foreign_requests = NULL;
+
+/*Whether the idle thread returns once only it and daemon threads are left*/
+int run_to_completion = 0;
+
+/*The shared stack, and the shared-stack thread whose frames are currently on it*/
+stack_pointer_t shared_stackbase;
+stack_pointer_t shared_stacktop;
+minithread_t shared_stack_owner;
+
+/*The helper context, and the shared-stack thread it is to switch to next*/
+stack_pointer_t copy_helper_stackbase;
+stack_pointer_t copy_helper_stacktop;
+minithread_t copy_helper_next;
+
+/*Free control blocks, chained through next, and their lock. Pooled blocks are never given back to malloc*/
+minithread_t free_tcbs;
+tas_lock_t tcbs_lock = 0;
+
+/*Whether new threads with a dedicated stack keep their control block at its top*/
+int tcb_on_stack = 0;
+
+/*Stack profiling mode and the per-procedure usage table (open addressing on proc)*/
+int stack_profile_mode = STACK_PROFILE_OFF;
+struct stack_profile stack_profiles[STACK_PROFILES];
+
+/*
+ *-----------------------
+ * processors
+ * ----------------------
+ */
+
+/*Take and release a lock shared between processors. With one processor there is nobody to keep out*/
+static void mp_lock(tas_lock_t* lock){
+	long spins = 0;
+
+	if(processor_count > 1){
+		while(atomic_test_and_set(lock)){
+			spin_wait(++spins);
+		}
+	}
+}
+
+static void mp_unlock(tas_lock_t* lock){
+	if(processor_count > 1){
+		atomic_clear(lock);
+	}
+}
+
+/*Threads waiting on the ready queues of all the processors*/
+static int runnable_count(){
+	int count = 0;
+	int i;
+
+	for(i = 0; i < processor_count; i++){
+		count += queue_length(processors[i].runqueue);
+	}
+	return count;
+}
+
+/*
+ * Move up to STEAL_BATCH threads, half of what is there, from the queue of
+ * the first other processor found with any to the queue of p. Returns the
+ * number of threads taken.
+ */
+static int processor_steal(processor_t* p){
+	minithread_t stolen[STEAL_BATCH];
+	processor_t* victim;
+	int count = 0;
+	int want;
+	int i;
+
+	for(i = 1; i < processor_count && count == 0; i++){
+		victim = &processors[(p->id + i) % processor_count];
+		/*Only lock a queue that looks worth it*/
+		if(queue_length(victim->runqueue) == 0){
+			continue;
+		}
+		mp_lock(&victim->lock);
+		want = (queue_length(victim->runqueue) + 1) / 2;
+		if(want > STEAL_BATCH){
+			want = STEAL_BATCH;
+		}
+		while(count < want){
+			queue_dequeue(victim->runqueue,(void**) &stolen[count++]);
+		}
+		mp_unlock(&victim->lock);
+	}
+	if(count > 0){
+		mp_lock(&p->lock);
+		AbortOnCondition(queue_append_all(p->runqueue,(void**) stolen,count) == -1, "No memory for stolen threads.");
+		mp_unlock(&p->lock);
+	}
+	return count;
+}
+
+int minithread_processors(int n) {
+	if(n == 0){
+		n = host_processor_count();
+		if(n > MINITHREAD_MAX_PROCESSORS){
+			n = MINITHREAD_MAX_PROCESSORS;
+		}
+	}
+	/*The count cannot change once the processors have queues*/
+	if(n < 0 || n > MINITHREAD_MAX_PROCESSORS || processors[0].runqueue != NULL){
+		return -1;
+	}
+	/*Nor go past one while something that only works on one is on*/
+	if(n > 1 && (eventtrace_enabled || perf_counting || stack_profile_mode != STACK_PROFILE_OFF)){
+		return -1;
+	}
+	processor_count = n;
+	return n;
+}
+
+int minithread_processor_id() {
+	return this_processor->id;
+}
+
+int minithread_processor_count() {
+	return processor_count;
+}
+
+/*
+ *-----------------------
+ * foreign host threads
+ * ----------------------
+ */
+
+/*Push the chain from newest to oldest (linked through next) in one step*/
+static void foreign_push(foreign_request_t newest, foreign_request_t oldest){
+	foreign_request_t head;
+
+	do{
+		head = foreign_requests;
+		oldest->next = head;
+	}while(compare_and_swap_pointer((void**) &foreign_requests, head, newest) != head);
+}
+
+/*
+ * Act on the requests of foreign host threads, oldest first. Run by the
+ * scheduler at switch points, on whichever processor finds any. A thread
+ * to start that has not stopped yet has its request put back, to be
+ * tried again at a later switch; one that has exited has it dropped.
+ * After FOREIGN_FORK_BATCH forks, or a fork that fails, the requests
+ * left are put back for a later drain.
+ */
+static void foreign_drain(){
+	foreign_request_t request = (foreign_request_t) swap_pointer((void**) &foreign_requests, NULL);
+	foreign_request_t oldest = NULL;
+	foreign_request_t newest;
+	foreign_request_t next;
+	int forks = 0;
+
+	while(request != NULL){
+		next = request->next;
+		request->next = oldest;
+		oldest = request;
+		request = next;
+	}
+	while(oldest != NULL){
+		request = oldest;
+		if(request->thread == NULL){
+			if(forks == FOREIGN_FORK_BATCH){
+				break;
+			}
+			if(minithread_fork(request->proc, request->arg) == NULL){
+				TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not fork a thread for a foreign host thread\n"));
+				break;
+			}
+			forks++;
+			oldest = request->next;
+			free(request);
+		}
+		else if(request->thread->status == THREAD_DEAD){
+			/*Exited without waiting for the start. Cleared last: the control block can go once it is*/
+			oldest = request->next;
+			request->queued = 0;
+		}
+		else if(request->thread->status != THREAD_STOPPED){
+			oldest = request->next;
+			foreign_push(request, request);
+		}
+		else{
+			oldest = request->next;
+			/*Cleared first: a start that comes in once t is running again must not be lost*/
+			request->queued = 0;
+			minithread_start(request->thread);
+		}
+	}
+	/*Put back what is left in one piece, so that it stays in order*/
+	if(oldest != NULL){
+		request = oldest;
+		newest = NULL;
+		while(request != NULL){
+			next = request->next;
+			request->next = newest;
+			newest = request;
+			request = next;
+		}
+		foreign_push(newest, oldest);
+	}
+}
+
+void minithread_start_from_foreign(minithread_t t) {
+	if(t == NULL){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not start thread. [thread is null]\n"));
+		return;
+	}
+	/*Already on the queue: that start has not taken effect yet*/
+	if(compare_and_swap(&t->foreign.queued, 0, 1) != 0){
+		return;
+	}
+	t->foreign.thread = t;
+	foreign_push(&t->foreign, &t->foreign);
+}
+
+int minithread_fork_from_foreign(proc_t proc, arg_t arg) {
+	foreign_request_t request = (foreign_request_t) malloc(sizeof(struct foreign_request));
+
+	if(request == NULL){
+		return -1;
+	}
+	request->thread = NULL;
+	request->proc = proc;
+	request->arg = arg;
+	foreign_push(request, request);
+	return 0;
+}
+
+/*
+ *-----------------------
+ * accounting
+ * ----------------------
+ */
+
+/*Move t to a new scheduling state, charging the time since its last change to the old one*/
+void thread_set_status(minithread_t t, thread_status_t status){
+	unsigned __int64 now = currentTimeCycles();
+
+	switch(t->status){
+	case THREAD_RUNNING:
+		t->runcycles += now - t->statechange;
+		break;
+	case THREAD_RUNNABLE:
+		t->runnablecycles += now - t->statechange;
+		/*The histograms are not shared between processors: only processor 0 records*/
+		if(status == THREAD_RUNNING && t != idle_thread && this_processor == &processors[0]){
+			histogram_record(queue_residency, (unsigned __int64) ((now - t->statechange) * ns_per_cycle));
+			if(t->woken){
+				histogram_record(wakeup_latency, (unsigned __int64) ((now - t->statechange) * ns_per_cycle));
+				t->woken = 0;
+			}
+		}
+		break;
+	case THREAD_STOPPED:
+		t->blockedcycles += now - t->statechange;
+		break;
+	default:
+		break;
+	}
+	t->status = status;
+	t->statechange = now;
+}
+
+/*Start the accounts of a new thread in the given state and add it to all_threads*/
+void thread_register(minithread_t t, thread_status_t status){
+	t->status = status;
+	t->statechange = currentTimeCycles();
+	t->runcycles = 0;
+	t->runnablecycles = 0;
+	t->blockedcycles = 0;
+	t->voluntary = 0;
+	t->involuntary = 0;
+	t->waits = 0;
+	t->woken = 0;
+	memset(&t->perf, 0, sizeof(perf_account_t));
+	t->logbuffer = NULL;
+	t->daemon = 0;
+	t->oncpu = (status == THREAD_RUNNING);
+	t->foreign.queued = 0;
+	t->prevthread = NULL;
+	mp_lock(&threads_lock);
+	t->nextthread = all_threads;
+	if(all_threads != NULL){
+		all_threads->prevthread = t;
+	}
+	all_threads = t;
+	thread_count++;
+	mp_unlock(&threads_lock);
+}
+
+void thread_unregister(minithread_t t){
+	mp_lock(&threads_lock);
+	if(t->prevthread != NULL){
+		t->prevthread->nextthread = t->nextthread;
+	}
+	else{
+		all_threads = t->nextthread;
+	}
+	if(t->nextthread != NULL){
+		t->nextthread->prevthread = t->prevthread;
+	}
+	if(t->daemon){
+		daemon_count--;
+	}
+	thread_count--;
+	mp_unlock(&threads_lock);
+}
+
+void minithread_get_stats(minithread_t t, minithread_stats_t* stats) {
+	unsigned __int64 now = currentTimeCycles();
+	double cycles_per_us = (double) cyclesPerSecond() / 1000000;
+	unsigned __int64 run = t->runcycles;
+	unsigned __int64 runnable = t->runnablecycles;
+	unsigned __int64 blocked = t->blockedcycles;
+
+	/*Include the time spent in the current state so far*/
+	if(t->status == THREAD_RUNNING){
+		run += now - t->statechange;
+	}
+	else if(t->status == THREAD_RUNNABLE){
+		runnable += now - t->statechange;
+	}
+	else if(t->status == THREAD_STOPPED){
+		blocked += now - t->statechange;
+	}
+
+	stats->id = t->id;
+	stats->run_us = (unsigned __int64) (run / cycles_per_us);
+	stats->runnable_us = (unsigned __int64) (runnable / cycles_per_us);
+	stats->blocked_us = (unsigned __int64) (blocked / cycles_per_us);
+	stats->voluntary_switches = t->voluntary;
+	stats->involuntary_switches = t->involuntary;
+	stats->waits = t->waits;
+}
+
+int minithread_get_all_stats(minithread_stats_t* stats, int max) {
+	minithread_t t;
+	int i = 0;
+
+	mp_lock(&threads_lock);
+	for(t = all_threads; t != NULL && i < max; t = t->nextthread){
+		minithread_get_stats(t, &stats[i++]);
+	}
+	mp_unlock(&threads_lock);
+	return i;
+}
+
+unsigned __int64 minithread_switch_count() {
+	unsigned __int64 count = 0;
+	int i;
+
+	for(i = 0; i < processor_count; i++){
+		count += processors[i].switches;
+	}
+	return count;
+}
+
+histogram_t minithread_histogram(int which) {
+	return (which == MINITHREAD_WAKEUP_LATENCY) ? wakeup_latency : queue_residency;
+}
+
+void minithread_latency_report() {
+	histogram_print(wakeup_latency, "wakeup to run", "ns");
+	histogram_print(queue_residency, "ready queue", "ns");
+}
+
+void minithread_stats_report() {
+	minithread_stats_t* stats;
+	int count = thread_count;
+	int i;
+
+	stats = (minithread_stats_t*) malloc(count * sizeof(minithread_stats_t));
+	if(stats == NULL){
+		return;
+	}
+	count = minithread_get_all_stats(stats, count);
+	printf("%6s %12s %12s %12s %8s %8s %8s\n","thread","run us","runnable us","blocked us","vol","invol","waits");
+	for(i = 0; i < count; i++){
+		printf("%6d %12llu %12llu %12llu %8ld %8ld %8ld\n",stats[i].id,
+		       stats[i].run_us,stats[i].runnable_us,stats[i].blocked_us,
+		       stats[i].voluntary_switches,stats[i].involuntary_switches,stats[i].waits);
+	}
+	free(stats);
+}
+
+/*Update the live statistics page. Called from the clock handler, so never interrupted*/
+void stats_page_publish(){
+	unsigned __int64 now = currentTimeCycles();
+	double cycles_per_us = (double) cyclesPerSecond() / 1000000;
+	unsigned __int64 elapsed = now - stats_page_updated;
+	unsigned __int64 switches = minithread_switch_count();
+	int dead = 0;
+	int i;
+
+	for(i = 0; i < processor_count; i++){
+		dead += processors[i].deadcount;
+	}
+	statspage_begin(stats_page);
+	stats_page->updates++;
+	stats_page->uptime_us = (unsigned __int64) ((now - stats_page_created) / cycles_per_us);
+	stats_page->ticks = ticks;
+	stats_page->runnable = runnable_count();
+	stats_page->threads = thread_count;
+	stats_page->dead_backlog = dead;
+	stats_page->switches = switches;
+	if(elapsed > 0){
+		stats_page->switches_per_sec = (unsigned __int64) ((switches - stats_page_switches)
+		                                                   * (double) cyclesPerSecond() / elapsed);
+	}
+	stats_page->interrupts_dropped = interrupts_dropped;
+	stats_page->interrupts_deferred = interrupts_deferred;
+	statspage_end(stats_page);
+
+	stats_page_updated = now;
+	stats_page_switches = switches;
+}
+
+int minithread_stats_page(char* filename) {
+	statspage_t* page = statspage_create(filename);
+
+	if(page == NULL){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not create statistics page %s\n",filename));
+		return -1;
+	}
+	page->period_us = PERIOD;
+	stats_page_created = currentTimeCycles();
+	stats_page_updated = stats_page_created;
+	stats_page_switches = minithread_switch_count();
+	stats_page = page;
+	minithread_clock_needed();
+	return 0;
+}
+
+/*
+ *-----------------------
+ * runaway detection
+ * ----------------------
+ */
+
+/*Record a runaway which has just reached the threshold. Runs in the clock device: only stores*/
+minithread_runaway_t* runaway_record(int kind, minithread_t t, void* pc){
+	minithread_runaway_t* runaway;
+
+	if(runaway_count == RUNAWAY_RECORDS){
+		runaway_missed++;
+		return NULL;
+	}
+	runaway = &runaways[runaway_count];
+	runaway->kind = kind;
+	runaway->thread = t->id;
+	runaway->proc = t->proc;
+	runaway->pc = pc;
+	runaway->ticks = runaway_threshold;
+	runaway_count++;
+	return runaway;
+}
+
+/*Tick hook: extend or end the current stretches, recording those reaching the threshold*/
+void runaway_tick(void* pc, int taken){
+	minithread_t t = current_thread;
+
+	if(t == NULL){
+		return;
+	}
+
+	/*The idle thread only runs while there is nothing else to run. The clock only interrupts processor 0*/
+	if(this_processor->switches == runaway_switches && t != idle_thread){
+		runaway_running++;
+	}
+	else{
+		runaway_running = 0;
+		runaway_running_record = NULL;
+		runaway_switches = this_processor->switches;
+	}
+	if(runaway_running == runaway_threshold){
+		runaway_running_record = runaway_record(MINITHREAD_RUNAWAY_RUNNING, t, pc);
+	}
+	else if(runaway_running > runaway_threshold && runaway_running_record != NULL){
+		runaway_running_record->ticks = runaway_running;
+	}
+
+	/*A tick taken as an interrupt found interrupts enabled, though they are disabled by now*/
+	if(!taken && interrupt_level == DISABLED){
+		runaway_disabled++;
+	}
+	else{
+		runaway_disabled = 0;
+		runaway_disabled_record = NULL;
+	}
+	if(runaway_disabled == runaway_threshold){
+		runaway_disabled_record = runaway_record(MINITHREAD_RUNAWAY_DISABLED, t, pc);
+	}
+	else if(runaway_disabled > runaway_threshold && runaway_disabled_record != NULL){
+		runaway_disabled_record->ticks = runaway_disabled;
+	}
+}
+
+int minithread_runaway_detect(int threshold) {
+	minithread_clock_tick_unhook(runaway_tick);
+	runaway_threshold = threshold;
+	if(threshold <= 0){
+		runaway_threshold = 0;
+		return 0;
+	}
+	runaway_running = 0;
+	runaway_disabled = 0;
+	runaway_running_record = NULL;
+	runaway_disabled_record = NULL;
+	runaway_switches = processors[0].switches;
+	minithread_clock_needed();
+	return minithread_clock_tick_hook(runaway_tick);
+}
+
+int minithread_get_runaways(minithread_runaway_t* records, int max) {
+	int i;
+
+	for(i = 0; i < runaway_count && i < max; i++){
+		records[i] = runaways[i];
+	}
+	return runaway_count;
+}
+
+void minithread_runaway_report() {
+	int i;
+
+	printf("%-9s %6s %-18s %-18s %8s %10s\n","kind","thread","proc","pc","ticks","ms");
+	for(i = 0; i < runaway_count; i++){
+		printf("%-9s %6d %-18p %-18p %8ld %10ld\n",
+		       (runaways[i].kind == MINITHREAD_RUNAWAY_DISABLED) ? "disabled" : "running",
+		       runaways[i].thread,(void*) runaways[i].proc,runaways[i].pc,
+		       runaways[i].ticks,runaways[i].ticks * (PERIOD / MILLISECOND));
+	}
+	if(runaway_missed > 0){
+		printf("(%ld more not recorded)\n",runaway_missed);
+	}
+}
+
+/*
+ *-----------------------
+ * hardware counters
+ * ----------------------
+ */
+
+/*Add the counts since the last read to totals*/
+void perf_charge(unsigned __int64* totals){
+	unsigned __int64 now[PERF_COUNTERS];
+	int i;
+
+	if(perfcounters_read(now) == -1){
+		return;
+	}
+	for(i = 0; i < PERF_COUNTERS; i++){
+		totals[i] += now[i] - perf_last[i];
+		perf_last[i] = now[i];
+	}
+}
+
+/*Keep the totals of a thread being reclaimed for the report*/
+void perf_keep(minithread_t t){
+	perf_record_t* records;
+	int capacity;
+
+	if(perf_exited_count == perf_exited_capacity){
+		capacity = (perf_exited_capacity == 0) ? 64 : 2 * perf_exited_capacity;
+		records = (perf_record_t*) realloc(perf_exited, capacity * sizeof(perf_record_t));
+		if(records == NULL){
+			return;
+		}
+		perf_exited = records;
+		perf_exited_capacity = capacity;
+	}
+	perf_exited[perf_exited_count].id = t->id;
+	perf_exited[perf_exited_count].perf = t->perf;
+	perf_exited_count++;
+}
+
+void perf_report_line(int id, perf_account_t* perf){
+	int i;
+
+	printf("%6d %8ld",id,perf->switches);
+	for(i = 0; i < PERF_COUNTERS; i++){
+		if(perfcounters_available(i)){
+			printf(" %14llu",perf->run[i]);
+		}
+		else{
+			printf(" %14s","-");
+		}
+	}
+	for(i = 0; i < PERF_COUNTERS; i++){
+		if(perfcounters_available(i) && perf->switches > 0){
+			printf(" %14llu",perf->switchin[i] / perf->switches);
+		}
+		else{
+			printf(" %14s","-");
+		}
+	}
+	printf("\n");
+}
+
+int minithread_perf_counters(int enabled) {
+	static int reported = 0;
+	int available;
+
+	if(!enabled){
+		perf_counting = 0;
+		return 0;
+	}
+	if(processor_count > 1){
+		return -1;
+	}
+	available = perfcounters_open();
+	if(available == -1 || perfcounters_read(perf_last) == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: No hardware performance counters\n"));
+		return -1;
+	}
+	perf_counting = 1;
+	if(!reported){
+		atexit(minithread_perf_report);
+		reported = 1;
+	}
+	return available;
+}
+
+void minithread_perf_report() {
+	minithread_t t;
+	int i;
+
+	/*Charge the running thread up to now*/
+	if(perf_counting && current_thread != NULL){
+		perf_charge(current_thread->perf.run);
+	}
+	printf("%6s %8s","thread","switches");
+	for(i = 0; i < PERF_COUNTERS; i++){
+		printf(" %14s",perf_counter_names[i]);
+	}
+	for(i = 0; i < PERF_COUNTERS; i++){
+		printf(" %10s/sw",perf_counter_names[i]);
+	}
+	printf("\n");
+	for(t = all_threads; t != NULL; t = t->nextthread){
+		perf_report_line(t->id, &t->perf);
+	}
+	for(i = 0; i < perf_exited_count; i++){
+		perf_report_line(perf_exited[i].id, &perf_exited[i].perf);
+	}
+}
+
+/*
+ *-----------------------
+ * control blocks
+ * ----------------------
+ */
+
+/*Return a control block to the pool*/
+void tcb_release(minithread_t t){
+	mp_lock(&tcbs_lock);
+	t->next = free_tcbs;
+	free_tcbs = t;
+	mp_unlock(&tcbs_lock);
+}
+
+/*
+ * Take n control blocks from the pool. If the pool runs short, the rest
+ * come from one new slab, whose leftovers stock the pool.
+ * Returns 0 on Success, (-1) on Failure (nothing taken)
+ */
+int tcb_alloc(int n, minithread_t* tcbs){
+	minithread_t slab;
+	int count;
+	int i = 0;
+
+	mp_lock(&tcbs_lock);
+	while(i < n && free_tcbs != NULL){
+		tcbs[i++] = free_tcbs;
+		free_tcbs = free_tcbs->next;
+	}
+	mp_unlock(&tcbs_lock);
+	if(i < n){
+		count = (n - i > TCB_SLAB_COUNT) ? n - i : TCB_SLAB_COUNT;
+		slab = (minithread_t) malloc(count * sizeof(struct minithread));
+		if(slab == NULL){
+			while(i > 0){
+				tcb_release(tcbs[--i]);
+			}
+			return -1;
+		}
+		while(i < n){
+			tcbs[i++] = slab++;
+			count--;
+		}
+		while(count-- > 0){
+			tcb_release(slab++);
+		}
+	}
+	return 0;
+}
+
+/*Carve a control block out of the top of a fresh dedicated stack, which then starts below it*/
+minithread_t tcb_carve(stack_pointer_t* stacktop){
+	minithread_t t = (minithread_t) (((size_t) *stacktop - sizeof(struct minithread)) & ~(size_t) 0xf);
 
-/*Queue ds representing the threads that need to be cleaned up*/
-queue_t cleanup_queue;
+	*stacktop = (stack_pointer_t) t;
+	return t;
+}
 
-/*Semaphore blocking the cleanup thread until there are elements in the cleanup_queue*/
-semaphore_t cleanup_sem;
+void minithread_tcb_on_stack(int enabled) {
+	tcb_on_stack = enabled;
+}
+
+/*
+ *-----------------------
+ * stack profiling
+ * ----------------------
+ */
+
+/*Returns the profile slot of proc, claiming a free one if create is set, or NULL*/
+stack_profile_t stack_profile_lookup(proc_t proc, int create){
+	int i;
+	int slot = (int) (((size_t) proc >> 4) % STACK_PROFILES);
+
+	for(i = 0; i < STACK_PROFILES; i++){
+		stack_profile_t profile = &stack_profiles[(slot + i) % STACK_PROFILES];
+		if(profile->proc == proc){
+			return profile;
+		}
+		if(profile->proc == NULL){
+			if(!create){
+				return NULL;
+			}
+			profile->proc = proc;
+			return profile;
+		}
+	}
+	return NULL;
+}
+
+/*Called with the peak stack usage of an exited thread as it is reclaimed*/
+void stack_profile_record(proc_t proc, int used){
+	stack_profile_t profile = stack_profile_lookup(proc, 1);
+
+	if(profile == NULL){
+		return;
+	}
+	profile->threads++;
+	if(used > profile->peak){
+		profile->peak = used;
+	}
+	if(profile->threads >= STACK_TUNE_SAMPLES){
+		profile->tunedsize = 2 * profile->peak + STACK_TUNE_SLACK;
+	}
+}
+
+int minithread_stack_profile(int mode) {
+	if(mode != STACK_PROFILE_OFF && processor_count > 1){
+		return -1;
+	}
+	stack_profile_mode = mode;
+	minithread_stack_paint(mode != STACK_PROFILE_OFF);
+	return 0;
+}
+
+void minithread_stack_report() {
+	int i;
+
+	printf("%-18s %8s %10s %10s\n","proc","threads","peak","tuned");
+	for(i = 0; i < STACK_PROFILES; i++){
+		stack_profile_t profile = &stack_profiles[i];
+		if(profile->proc != NULL){
+			printf("%-18p %8d %10d %10d\n",(void*) profile->proc,
+			       profile->threads,profile->peak,profile->tunedsize);
+		}
+	}
+}
+
+/*
+ *-----------------------
+ * shared stacks
+ * ----------------------
+ */
+
+/*Move the owner's frames off the shared stack into its savedstack buffer*/
+void shared_stack_copy_out(){
+	minithread_t t = shared_stack_owner;
+	int size;
+
+	if(t == NULL){
+		return;
+	}
+	/*The frames of a thread that has exited are not worth saving*/
+	if(t->status == THREAD_DEAD){
+		shared_stack_owner = NULL;
+		return;
+	}
+	size = (int) ((char*) shared_stacktop - (char*) t->stacktop);
+	if(size > t->savedcapacity){
+		free(t->savedstack);
+		t->savedstack = (char*) malloc(size);
+		AbortOnCondition(t->savedstack == NULL, "Out of memory saving a shared stack.");
+		t->savedcapacity = size;
+	}
+	memcpy(t->savedstack, t->stacktop, size);
+	t->savedsize = size;
+	shared_stack_owner = NULL;
+}
+
+/*Put t's frames back on the shared stack, at the addresses they were taken from*/
+void shared_stack_copy_in(minithread_t t){
+	memcpy(t->stacktop, t->savedstack, t->savedsize);
+	shared_stack_owner = t;
+}
+
+/*Body of the helper context: runs between two shared-stack threads*/
+int copy_helper_proc(arg_t copy_args){
+	while(1){
+		shared_stack_copy_out();
+		shared_stack_copy_in(copy_helper_next);
+		minithread_switch(&copy_helper_stacktop,&(copy_helper_next->stacktop));
+	}
+}
+
+/*Allocate the shared stack and the helper context on first use. Returns 0 or -1*/
+int shared_stack_initialize(){
+	minithread_allocate_stack_ex(&shared_stackbase,&shared_stacktop,SHARED_STACK_SIZE);
+	minithread_allocate_stack_ex(&copy_helper_stackbase,&copy_helper_stacktop,COPY_HELPER_STACK_SIZE);
+	if(shared_stackbase == NULL || copy_helper_stackbase == NULL){
+		return -1;
+	}
+	minithread_initialize_stack(&copy_helper_stacktop, copy_helper_proc, NULL, copy_helper_proc, NULL);
+	return 0;
+}
+
+/*Run on arrival in a thread: the one this processor switched away from now has its context saved*/
+static void switch_finish(){
+	if(processor_count > 1){
+		BARRIER();
+	}
+	this_processor->switchedfrom->oncpu = 0;
+}
+
+/*First procedure of every thread: finish the switch into it, then run its body*/
+static int thread_start(arg_t arg){
+	minithread_t t = (minithread_t) arg;
+
+	switch_finish();
+	return t->proc(t->arg);
+}
+
+/*
+ * Switch the processor from previous to next. If next is a shared-stack
+ * thread whose frames are not on the shared stack, they are copied in
+ * first (after copying out the owner's); when previous is itself running
+ * on the shared stack, the copying is done from the helper context.
+ * While counting, the hardware counters are read on both sides of the
+ * switch.
+ *
+ * With several processors, next may have been made runnable before the
+ * processor it last ran on finished switching away from it, so the switch
+ * waits until next is off that processor. The far side of every switch,
+ * whichever thread it is in, starts with switch_finish.
+ */
+void context_switch(minithread_t previous, minithread_t next){
+	long spins = 0;
+
+	EVENT_TRACE(EVENT_SWITCH, previous->id, next->id, NULL);
+	this_processor->switches++;
+	if(perf_counting){
+		perf_charge(previous->perf.run);
+	}
+	if(processor_count > 1){
+		while(next->oncpu){
+			spin_wait(++spins);
+		}
+	}
+	next->oncpu = 1;
+	this_processor->switchedfrom = previous;
+	if(!next->shared || next == shared_stack_owner){
+		minithread_switch(&(previous->stacktop),&(next->stacktop));
+	}
+	else if(previous == shared_stack_owner){
+		copy_helper_next = next;
+		minithread_switch(&(previous->stacktop),&copy_helper_stacktop);
+	}
+	else{
+		shared_stack_copy_out();
+		shared_stack_copy_in(next);
+		minithread_switch(&(previous->stacktop),&(next->stacktop));
+	}
+	switch_finish();
+	/*previous is running again: what it took to get here is the cost of switching to it*/
+	if(perf_counting){
+		perf_charge(previous->perf.switchin);
+		previous->perf.switches++;
+	}
+}
 
 /*
  *-----------------------
@@ -58,86 +1185,435 @@ semaphore_t cleanup_sem;
  */
 
 
+/*Free the stacks and control blocks of the threads on the dead list. Must not run on a dead thread*/
+void reap_dead_threads(){
+	int thread_id;
+	minithread_t temp;
+	minithread_t kept = NULL;
+
+	while(dead_threads != NULL){
+		temp = dead_threads;
+		dead_threads = temp->next;
+		/*A start from a foreign host thread still queued lives in the control block; the next drain drops it*/
+		if(temp->foreign.queued){
+			temp->next = kept;
+			kept = temp;
+			continue;
+		}
+		dead_count--;
+		thread_id = temp->id;
+		thread_unregister(temp);
+		if(temp->logbuffer != NULL){
+			klog_thread_exit(temp->logbuffer);
+		}
+		if(perf_counting || temp->perf.switches > 0){
+			perf_keep(temp);
+		}
+		if(shared_stack_owner == temp){
+			shared_stack_owner = NULL;
+		}
+		if(temp->stackpainted){
+			stack_profile_record(temp->proc,
+			                     minithread_stack_used(temp->stackbase,temp->stacksize));
+		}
+		if(temp->shared){
+			free(temp->savedstack);
+			tcb_release(temp);
+		}
+		else if(temp->tcbonstack){
+			/*The control block goes away with the stack*/
+			minithread_free_stack_ex(temp->stackbase,temp->stacksize);
+		}
+		else{
+			minithread_free_stack_ex(temp->stackbase,temp->stacksize);
+			tcb_release(temp);
+		}
+		TRACE(TRACE_SCHED, TRACE_INFO, ("Freed thread ID: %d\n",thread_id));
+	}
+	dead_threads = kept;
+}
+
 /*The final procedure a minithreads executes on termination
  * TODO: What is the propper arguements/return type of this function?
  */
 int final_proc(arg_t final_args){
-	stack_pointer_t previous_sp = current_thread->stacktop;
-	queue_append(cleanup_queue, minithread_self());
-	semaphore_V(cleanup_sem);
-	printf("Final procedure for thread id %d done, switching to idle thread\n",minithread_self()->id);
-	current_thread = idle_thread;
-	minithread_switch(&(previous_sp),&(idle_thread->stacktop));
+	minithread_t previous_thread = current_thread;
+
+	if(foreign_requests != NULL){
+		foreign_drain();
+	}
+
+	/*This thread's stack is still in use, so it can only go on the dead list for later. The list is
+	  this processor's, so nobody reclaims the thread before the switch away from it is done*/
+	if(dead_count >= DEAD_REAP_BATCH){
+		reap_dead_threads();
+	}
+	EVENT_TRACE(EVENT_EXIT, previous_thread->id, -1, NULL);
+	previous_thread->voluntary++;
+	thread_set_status(previous_thread, THREAD_DEAD);
+	previous_thread->next = dead_threads;
+	dead_threads = previous_thread;
+	dead_count++;
+
+	/*Run the next thread straight away. A dead owner of the shared stack stays its
+	  owner until then, so that frames are never copied over the stack in use*/
+	mp_lock(&this_processor->lock);
+	if(queue_dequeue(runnable_queue,(void**) &current_thread) == -1){
+		current_thread = idle_thread;
+	}
+	mp_unlock(&this_processor->lock);
+	thread_set_status(current_thread, THREAD_RUNNING);
+	TRACE(TRACE_SCHED, TRACE_INFO, ("Final procedure for thread id %d done, switching to thread %d\n",previous_thread->id,current_thread->id));
+	context_switch(previous_thread,current_thread);
 	while(1);
 }
 
+/*Clock interrupt handler: keeps time and the statistics page (interrupts are re-enabled when it returns)*/
+void clock_handler(void* arg){
+	ticks++;
+	if(stats_page != NULL){
+		stats_page_publish();
+	}
+}
+
+/*Start the clock. The ticks go to the host thread calling, which must be processor 0's*/
+static void clock_start(){
+	if(!clock_running){
+		minithread_clock_init(clock_handler);
+		clock_running = 1;
+	}
+	clock_pending = 0;
+}
+
+void minithread_clock_needed() {
+	if(clock_running){
+		return;
+	}
+	if(processors[0].runqueue != NULL && !processors_stopping && this_processor == &processors[0]){
+		clock_start();
+	}
+	else{
+		clock_pending = 1;
+	}
+}
+
 int idle_thread_proc(arg_t idle_args){
-	/*Never terminate, constantly yielding allowing any new threads to be run*/
+	processor_t* p = this_processor;
+	int spins = 0;
+
+	/*Constantly yield allowing any new threads to be run. Only terminates in run to completion
+	  mode, once every thread but the daemons and the idle threads has exited and been reclaimed
+	  and nothing is runnable; the other processors then stop too*/
 	while(1){
+		if(dead_threads != NULL){
+			reap_dead_threads();
+		}
+		/*The logger writes out the log only when there is nothing else to do*/
+		klog_idle();
+		if(p->id == 0){
+			if(run_to_completion && thread_count - daemon_count == processor_count && runnable_count() == 0
+			   && foreign_requests == NULL){
+				processors_stopping = 1;
+				return 0;
+			}
+		}
+		else if(processors_stopping){
+			return 0;
+		}
+		/*With nothing of its own to run, look for something on the other processors, and let
+		  the host run its other threads (such as the foreign ones) if that keeps failing*/
+		if(queue_length(runnable_queue) == 0){
+			if(processor_count > 1 && processor_steal(p) > 0){
+				spins = 0;
+			}
+			else if(++spins == IDLE_SPINS){
+				spins = 0;
+				host_thread_yield();
+			}
+			else{
+				processor_relax();
+			}
+		}
 		minithread_yield();
 	}
 }
 
-int cleanup_thread_proc(arg_t cleanup_args){
-	int thread_id;
-	minithread_t temp;
-	while(1){
-		semaphore_P(cleanup_sem);
-		
-		queue_dequeue(cleanup_queue,(void**) &temp);
-		thread_id = temp->id;
-		minithread_free_stack(temp->stackbase);
-		printf("Freed thread ID: %d\n",thread_id);
-	}
+/*Body of the host thread of every processor but 0*/
+static int processor_main(arg_t arg){
+	this_processor = (processor_t*) arg;
+	return idle_thread_proc(NULL);
 }
 
 
 /*Returns a new 'unique' (thread_id >= 0) on Sucess, (-1) on Failure*/
 int new_thread_id(){
 	int temp;
+	mp_lock(&threads_lock);
 	if(thread_id_counter <= INT_MAX){
 		temp = thread_id_counter;
 		thread_id_counter++;
+		mp_unlock(&threads_lock);
 		return temp;
 	}
 	else{
-		printf("ERROR: Cannot assign new thread id\n");
+		mp_unlock(&threads_lock);
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Cannot assign new thread id\n"));
 		return -1;
 	}
 }
 
+/*Fill in a new thread whose dedicated stack has been allocated, and build its initial frame*/
+static void minithread_setup(minithread_t t, proc_t proc, arg_t arg, int stack_size) {
+	t->stacksize = stack_size;
+	t->stackpainted = (stack_profile_mode != STACK_PROFILE_OFF);
+	t->proc = proc;
+	t->arg = arg;
+	t->id = new_thread_id();
+	thread_register(t, THREAD_STOPPED);
+	t->shared = 0;
+	t->savedstack = NULL;
+	t->savedsize = 0;
+	t->savedcapacity = 0;
+	minithread_initialize_stack(&t->stacktop, thread_start, (arg_t) t, (proc_t)final_proc, NULL);
+}
+
 minithread_t minithread_fork(proc_t proc, arg_t arg) {
-	minithread_t new_thread = minithread_create(proc,arg);
+	return minithread_fork_ex(proc,arg,0);
+}
+
+minithread_t minithread_fork_ex(proc_t proc, arg_t arg, int stack_size) {
+	minithread_t new_thread = minithread_create_ex(proc,arg,stack_size);
 
 	if(new_thread == NULL) {
-		printf("ERROR: Could not start thread. [thread is null]\n");
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not start thread. [thread is null]\n"));
 		return NULL;
 	}
 
 	/*Append the new thread to the run queue*/
+	thread_set_status(new_thread, THREAD_RUNNABLE);
+	mp_lock(&this_processor->lock);
 	queue_append(runnable_queue, new_thread);
+	mp_unlock(&this_processor->lock);
+	EVENT_TRACE(EVENT_FORK, current_thread->id, new_thread->id, NULL);
 
 	return new_thread;
 }
 
 minithread_t minithread_create(proc_t proc, arg_t arg) {
-	minithread_t new_thread = (minithread_t) malloc(sizeof(struct minithread));
+	return minithread_create_ex(proc,arg,0);
+}
+
+minithread_t minithread_create_ex(proc_t proc, arg_t arg, int stack_size) {
+	minithread_t new_thread;
+	stack_pointer_t stackbase;
+	stack_pointer_t stacktop;
+	stack_profile_t profile;
+
+	/*Unless told otherwise, size the stack from what earlier threads of proc used*/
+	if(stack_size == 0 && stack_profile_mode == STACK_PROFILE_TUNE){
+		profile = stack_profile_lookup(proc, 0);
+		if(profile != NULL){
+			stack_size = profile->tunedsize;
+		}
+	}
 
-	if(new_thread == NULL){
-		printf("ERROR: Memmory allocation for new thread failed\n");
+	minithread_allocate_stack_ex(&stackbase,&stacktop,stack_size);
+	if(stackbase == NULL){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Stack allocation for new thread failed\n"));
 		return NULL;
 	}
+	if(tcb_on_stack){
+		new_thread = tcb_carve(&stacktop);
+	}
+	else if(tcb_alloc(1, &new_thread) == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Memmory allocation for new thread failed\n"));
+		minithread_free_stack_ex(stackbase,stack_size);
+		return NULL;
+	}
+	new_thread->stackbase = stackbase;
+	new_thread->stacktop = stacktop;
+	new_thread->tcbonstack = tcb_on_stack;
+	minithread_setup(new_thread, proc, arg, stack_size);
+	return new_thread;
+}
+
+minithread_t minithread_fork_shared(proc_t proc, arg_t arg) {
+	minithread_t new_thread = minithread_create_shared(proc,arg);
+
+	if(new_thread == NULL) {
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not start thread. [thread is null]\n"));
+		return NULL;
+	}
+
+	/*Append the new thread to the run queue*/
+	thread_set_status(new_thread, THREAD_RUNNABLE);
+	mp_lock(&this_processor->lock);
+	queue_append(runnable_queue, new_thread);
+	mp_unlock(&this_processor->lock);
+	EVENT_TRACE(EVENT_FORK, current_thread->id, new_thread->id, NULL);
+
+	return new_thread;
+}
 
-	minithread_allocate_stack(&new_thread->stackbase,&new_thread->stacktop);
+minithread_t minithread_create_shared(proc_t proc, arg_t arg) {
+	minithread_t new_thread;
+	stack_pointer_t frame[INITIAL_FRAME_WORDS];
+	stack_pointer_t frametop = (stack_pointer_t) ((size_t) (frame + INITIAL_FRAME_WORDS) & ~0xf);
+
+	/*There is one shared stack, but several processors: each thread gets a stack of its own*/
+	if(processor_count > 1){
+		return minithread_create(proc, arg);
+	}
+
+	if(shared_stackbase == NULL && shared_stack_initialize() == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Shared stack allocation failed\n"));
+		return NULL;
+	}
+
+	if(tcb_alloc(1, &new_thread) == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Memmory allocation for new thread failed\n"));
+		return NULL;
+	}
+
+	/*Build the initial frame here, then save it as if it had been copied off the shared stack*/
+	new_thread->stacktop = frametop;
+	new_thread->arg = arg;
+	minithread_initialize_stack(&new_thread->stacktop, thread_start, (arg_t) new_thread, (proc_t)final_proc, NULL);
+	new_thread->savedsize = (int) ((char*) frametop - (char*) new_thread->stacktop);
+	new_thread->savedcapacity = new_thread->savedsize;
+	new_thread->savedstack = (char*) malloc(new_thread->savedsize);
+	if(new_thread->savedstack == NULL){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Memmory allocation for new thread failed\n"));
+		tcb_release(new_thread);
+		return NULL;
+	}
+	memcpy(new_thread->savedstack, new_thread->stacktop, new_thread->savedsize);
+	new_thread->stacktop = (stack_pointer_t) ((char*) shared_stacktop - new_thread->savedsize);
+
+	new_thread->stackbase = NULL;
+	new_thread->stacksize = 0;
+	new_thread->stackpainted = 0;
+	new_thread->proc = proc;
 	new_thread->id = new_thread_id();
-	minithread_initialize_stack(&new_thread->stacktop, proc, arg, (proc_t)final_proc, NULL);
+	thread_register(new_thread, THREAD_STOPPED);
+	new_thread->shared = 1;
+	new_thread->tcbonstack = 0;
 	return new_thread;
 }
 
+int minithread_fork_batch(int n, proc_t* procs, arg_t* args, minithread_t* out_threads) {
+	minithread_t* threads = out_threads;
+	stack_pointer_t* stackbases;
+	stack_pointer_t* stacktops;
+	stack_profile_t profile;
+	int stack_size = 0;
+	int i;
+
+	if(n <= 0){
+		return (n == 0) ? 0 : -1;
+	}
+
+	/*Size every stack in the batch for the hungriest proc that has been tuned*/
+	if(stack_profile_mode == STACK_PROFILE_TUNE){
+		for(i = 0; i < n; i++){
+			profile = stack_profile_lookup(procs[i], 0);
+			if(profile == NULL){
+				stack_size = 0;
+				break;
+			}
+			if(profile->tunedsize > stack_size){
+				stack_size = profile->tunedsize;
+			}
+		}
+	}
+
+	stackbases = (stack_pointer_t*) malloc(2 * n * sizeof(stack_pointer_t));
+	if(threads == NULL){
+		threads = (minithread_t*) malloc(n * sizeof(minithread_t));
+	}
+	if(stackbases == NULL || threads == NULL){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Memmory allocation for new threads failed\n"));
+		goto fail;
+	}
+	stacktops = stackbases + n;
+
+	if(minithread_allocate_stacks(n, stackbases, stacktops, stack_size) == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Stack allocation for new threads failed\n"));
+		goto fail;
+	}
+	if(tcb_on_stack){
+		for(i = 0; i < n; i++){
+			threads[i] = tcb_carve(&stacktops[i]);
+		}
+	}
+	else if(tcb_alloc(n, threads) == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Memmory allocation for new threads failed\n"));
+		goto fail_stacks;
+	}
+
+	for(i = 0; i < n; i++){
+		threads[i]->stackbase = stackbases[i];
+		threads[i]->stacktop = stacktops[i];
+		threads[i]->tcbonstack = tcb_on_stack;
+		minithread_setup(threads[i], procs[i], args[i], stack_size);
+		thread_set_status(threads[i], THREAD_RUNNABLE);
+	}
+
+	/*Make the whole batch runnable at once*/
+	mp_lock(&this_processor->lock);
+	i = queue_append_all(runnable_queue, (void**) threads, n);
+	mp_unlock(&this_processor->lock);
+	if(i == -1){
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not start threads. [run queue]\n"));
+		for(i = 0; i < n; i++){
+			thread_unregister(threads[i]);
+			if(!tcb_on_stack){
+				tcb_release(threads[i]);
+			}
+		}
+		goto fail_stacks;
+	}
+
+	if(eventtrace_enabled){
+		for(i = 0; i < n; i++){
+			eventtrace_record(EVENT_FORK, current_thread->id, threads[i]->id, NULL);
+		}
+	}
+
+	free(stackbases);
+	if(threads != out_threads){
+		free(threads);
+	}
+	return 0;
+
+fail_stacks:
+	for(i = 0; i < n; i++){
+		minithread_free_stack_ex(stackbases[i], stack_size);
+	}
+fail:
+	free(stackbases);
+	if(threads != out_threads){
+		free(threads);
+	}
+	return -1;
+}
+
 minithread_t minithread_self() {
 	return current_thread;
 }
 
+int minithread_get_id(minithread_t t) {
+	return t->id;
+}
+
+void* minithread_get_log_buffer(minithread_t t) {
+	return t->logbuffer;
+}
+
+void minithread_set_log_buffer(minithread_t t, void* buffer) {
+	t->logbuffer = buffer;
+}
+
 int minithread_id() {
 	if(current_thread != NULL){
 		return current_thread->id;
@@ -146,21 +1622,37 @@ int minithread_id() {
 }
 
 void minithread_stop() {
+	minithread_unlock_and_stop(NULL);
+}
+
+void minithread_unlock_and_stop(tas_lock_t* lock) {
 	minithread_t previous_thread = current_thread;
-	
-	//Get the number of threads waiting to run
-	int length = queue_length(runnable_queue);
+	processor_t* p = this_processor;
+
+	//Before the caller is stopped: a start of the caller itself must wait until it is
+	if(foreign_requests != NULL){
+		foreign_drain();
+	}
+
+	previous_thread->voluntary++;
+	previous_thread->waits++;
+	thread_set_status(previous_thread, THREAD_STOPPED);
+
+	//Whoever holds the lock next may start the thread again, and finds it stopped. Another
+	//processor can take it from then on, but cannot run it before the switch below is done
+	if(lock != NULL){
+		atomic_clear(lock);
+	}
 
 	//There are no threads to context switch to so switch to the idle thread
-	if(length == 0) {
+	mp_lock(&p->lock);
+	if(queue_dequeue(runnable_queue,(void**) &current_thread) == -1) {
 		current_thread = idle_thread;
-		
 	}
-	else{
-		queue_dequeue(runnable_queue,(void**) &current_thread);
-	}
-	printf("[MINITHREAD_STOP] Switching from thread %d to thread %d\n",previous_thread->id,current_thread->id);
-	minithread_switch(&(previous_thread->stacktop),&(current_thread->stacktop));
+	mp_unlock(&p->lock);
+	thread_set_status(current_thread, THREAD_RUNNING);
+	TRACE(TRACE_SCHED, TRACE_DEBUG, ("[MINITHREAD_STOP] Switching from thread %d to thread %d\n",previous_thread->id,current_thread->id));
+	context_switch(previous_thread,current_thread);
 }
 
 
@@ -171,10 +1663,14 @@ void minithread_stop() {
 
 void minithread_start(minithread_t t) {
 	if (t != NULL){
+		thread_set_status(t, THREAD_RUNNABLE);
+		t->woken = 1;
+		mp_lock(&this_processor->lock);
 		queue_append(runnable_queue, t);
+		mp_unlock(&this_processor->lock);
 	}
 	else{
-		printf("ERROR: Could not start thread. [thread is null]\n");
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not start thread. [thread is null]\n"));
 	}	
 }
 
@@ -183,28 +1679,99 @@ void minithread_yield() {
 	//Volentarily give up the CPU & let another thread from the runnable queue run
 
 	minithread_t previous_thread = current_thread;
-	
-	int length = queue_length(runnable_queue);
+	processor_t* p = this_processor;
+
+	if(foreign_requests != NULL){
+		foreign_drain();
+	}
+	if(clock_pending && p->id == 0){
+		clock_start();
+	}
 	
 	//There are no threads to context switch to just return
-	if(length == 0) {
-		printf("[MINITHREAD_YIELD] Not yielding thread %d, no other runnable threads\n",previous_thread->id);
+	if(queue_length(runnable_queue) == 0) {
+		TRACE(TRACE_SCHED, TRACE_DEBUG, ("[MINITHREAD_YIELD] Not yielding thread %d, no other runnable threads\n",previous_thread->id));
+		return;
+	}
+
+	mp_lock(&p->lock);
+	//Another processor stole them all after all
+	if(queue_length(runnable_queue) == 0) {
+		mp_unlock(&p->lock);
 		return;
 	}
 
 	//There are runnable threads
+	//The idle thread is never queued: it runs whenever the queue is empty
+	thread_set_status(previous_thread, THREAD_RUNNABLE);
 	if(current_thread != idle_thread){
+		//A yield with interrupts disabled comes from an interrupt handler preempting the thread
+		if(interrupt_level == DISABLED){
+			previous_thread->involuntary++;
+		}
+		else{
+			previous_thread->voluntary++;
+		}
 		queue_append(runnable_queue,previous_thread);
 	}
 
 	queue_dequeue(runnable_queue,(void**) &current_thread);
+	mp_unlock(&p->lock);
+	thread_set_status(current_thread, THREAD_RUNNING);
 
 
-	printf("[MINITHREAD_YIELD] Switching from thread %d to thread %d\n",previous_thread->id,current_thread->id);
-	minithread_switch(&(previous_thread->stacktop),&(current_thread->stacktop));
+	TRACE(TRACE_SCHED, TRACE_DEBUG, ("[MINITHREAD_YIELD] Switching from thread %d to thread %d\n",previous_thread->id,current_thread->id));
+	context_switch(previous_thread,current_thread);
 	
 }
 
+/*
+ * Hand the processor from the calling thread straight to t, leaving the
+ * caller in the given state. Only t is looked for on the run queue, and only
+ * if it is actually runnable; the caller is requeued only if asked to be.
+ * Only this processor's run queue is looked at: a thread runnable on
+ * another is left there. Returns -1 (without switching) if t cannot be run.
+ */
+static int minithread_handoff(minithread_t t, thread_status_t previous_status, char* caller) {
+	minithread_t previous_thread = current_thread;
+	processor_t* p = this_processor;
+
+	if(t == NULL || t == previous_thread || t == idle_thread || t->status == THREAD_DEAD
+	   || t->status == THREAD_RUNNING) {
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not switch to thread. [thread is not runnable]\n"));
+		return -1;
+	}
+
+	mp_lock(&p->lock);
+	if(t->status == THREAD_RUNNABLE && queue_delete(runnable_queue,(void**) &t) == -1){
+		mp_unlock(&p->lock);
+		TRACE(TRACE_SCHED, TRACE_ERROR, ("ERROR: Could not switch to thread. [thread is on another processor]\n"));
+		return -1;
+	}
+
+	if(previous_status == THREAD_RUNNABLE && previous_thread != idle_thread){
+		queue_append(runnable_queue,previous_thread);
+	}
+	mp_unlock(&p->lock);
+	previous_thread->voluntary++;
+	thread_set_status(previous_thread, previous_status);
+
+	current_thread = t;
+	thread_set_status(current_thread, THREAD_RUNNING);
+
+	TRACE(TRACE_SCHED, TRACE_DEBUG, ("[%s] Switching from thread %d to thread %d\n",caller,previous_thread->id,current_thread->id));
+	context_switch(previous_thread,current_thread);
+	return 0;
+}
+
+void minithread_switch_to(minithread_t t) {
+	minithread_handoff(t, THREAD_STOPPED, "MINITHREAD_SWITCH_TO");
+}
+
+void minithread_yield_to(minithread_t t) {
+	minithread_handoff(t, THREAD_RUNNABLE, "MINITHREAD_YIELD_TO");
+}
+
 /*
  * Initialization.
  *
@@ -219,27 +1786,89 @@ void minithread_yield() {
  * 	 Start scheduling.
  *
  */
-void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
-	runnable_queue = queue_new();
-	cleanup_queue = queue_new();
-	cleanup_sem = semaphore_create();
-	semaphore_initialize(cleanup_sem,0);
+static void system_start(proc_t mainproc, arg_t mainarg) {
+	processor_t* p;
+	int i;
 
-	//Allocate space for the idle thread store the sp of the main thread
-	idle_thread = (minithread_t) malloc(sizeof(struct minithread));
-	thread_id_counter = 0;
-	idle_thread->id = thread_id_counter;
-	
-	thread_id_counter++;
+	queue_residency = histogram_new();
+	wakeup_latency = histogram_new();
+	AbortOnCondition(queue_residency == NULL || wakeup_latency == NULL, "No memory for histograms.");
+	ns_per_cycle = 1000000000.0 / cyclesPerSecond();
 
-	current_thread = idle_thread;
+	//Allocate space for the idle threads, the first of which stores the sp of the main thread
+	thread_id_counter = 0;
+	for(i = 0; i < processor_count; i++){
+		p = &processors[i];
+		p->id = i;
+		p->runqueue = queue_new();
+		AbortOnCondition(p->runqueue == NULL || tcb_alloc(1, &p->idle) == -1, "No memory for the idle thread.");
+		memset(p->idle, 0, sizeof(struct minithread));
+		p->idle->id = new_thread_id();
+		thread_register(p->idle, THREAD_RUNNING);
+		p->current = p->idle;
+	}
 	
-	minithread_fork(cleanup_thread_proc,NULL);
 	minithread_fork(mainproc, mainarg);
-	
+
+	/*Only for whatever asked for it before the start; most programs never need the clock*/
+	if(clock_pending){
+		clock_start();
+	}
+
+	for(i = 1; i < processor_count; i++){
+		AbortOnCondition(host_thread_start(processor_main, (arg_t) &processors[i]) == -1, "Could not start a processor.");
+	}
+}
+
+void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
+	AbortOnCondition(processors[0].runqueue != NULL, "The system has already been started.");
+	system_start(mainproc, mainarg);
 	idle_thread_proc(NULL);
 }
 
+/*
+ * minithread_system_run:
+ *	 Like minithread_system_initialize, but the idle thread (which runs on
+ *	 the caller's stack) returns once the other threads are done, and the
+ *	 totals of the run are handed back. The clock, if it was started, is
+ *	 stopped before it returns.
+ */
+int minithread_system_run(proc_t mainproc, arg_t mainarg, minithread_run_stats_t* stats) {
+	unsigned __int64 begin = currentTimeCycles();
+
+	/*The daemon threads and the idle TCBs outlive the run*/
+	if(processors[0].runqueue != NULL){
+		return -1;
+	}
+
+	run_to_completion = 1;
+	system_start(mainproc, mainarg);
+	idle_thread_proc(NULL);
+
+	set_interrupt_level(DISABLED);
+	if(clock_running){
+		minithread_clock_stop();
+		clock_running = 0;
+	}
+	run_to_completion = 0;
+
+	if(stats != NULL){
+		stats->threads_created = thread_id_counter - processor_count;
+		stats->switches = minithread_switch_count();
+		stats->elapsed_us = (unsigned __int64) ((currentTimeCycles() - begin) * ns_per_cycle / 1000);
+	}
+	return 0;
+}
+
+void minithread_daemon(minithread_t t) {
+	mp_lock(&threads_lock);
+	if(!t->daemon){
+		t->daemon = 1;
+		daemon_count++;
+	}
+	mp_unlock(&threads_lock);
+}
+
 
 /*
 minithread_t temp;
@@ -247,7 +1876,7 @@ minithread_t temp;
 			queue_dequeue(cleanup_queue,(void**) &temp);
 			thread_id = temp->id;
 			printf("Freeing thread ID: %d\n",thread_id);
-			minithread_free_stack(temp->stackbase);
+			minithread_free_stack_ex(temp->stackbase,temp->stacksize);
 			printf("Freed up thread ID: %d\n",thread_id);
 */
 
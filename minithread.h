@@ -2,6 +2,7 @@
 #define __MINITHREAD_H__
 
 #include "machineprimitives.h"
+#include "histogram.h"
 
 /*
  * minithread.h:
@@ -40,6 +41,67 @@ extern minithread_t minithread_fork(proc_t proc, arg_t arg);
  */
 extern minithread_t minithread_create(proc_t proc, arg_t arg);
 
+/*
+ * minithread_t
+ * minithread_fork_ex(proc_t proc, arg_t arg, int stack_size)
+ * minithread_create_ex(proc_t proc, arg_t arg, int stack_size)
+ *	Like minithread_fork and minithread_create, but the thread gets a
+ *	stack of stack_size bytes (0 selects the default). On Linux, stack
+ *	pages only take up memory once they are touched, so threads that
+ *	stay shallow cost little more than their deepest call chain; on NT
+ *	the whole stack is committed when it is allocated.
+ *
+ *	Every thread with a stack of its own takes two kernel mappings, so
+ *	at the default vm.max_map_count of 65530 a Linux process tops out
+ *	near 32000 such threads. Hundreds of thousands of threads need
+ *	minithread_fork_shared.
+ */
+extern minithread_t minithread_fork_ex(proc_t proc, arg_t arg, int stack_size);
+
+extern minithread_t minithread_create_ex(proc_t proc, arg_t arg, int stack_size);
+
+/*
+ * minithread_t
+ * minithread_fork_shared(proc_t proc, arg_t arg)
+ * minithread_create_shared(proc_t proc, arg_t arg)
+ *	Like minithread_fork and minithread_create, but the thread has no
+ *	stack of its own: all such threads execute on one shared stack, and
+ *	the part of it a thread is using is copied to the heap when another
+ *	shared-stack thread needs to run. A thread that blocks with a few
+ *	hundred bytes of frames costs only that much memory, at the price of
+ *	copying them on context switches between shared-stack threads.
+ *	Other threads must not be handed pointers into the stack of a
+ *	shared-stack thread, since its frames are elsewhere while it is not
+ *	running.
+ */
+extern minithread_t minithread_fork_shared(proc_t proc, arg_t arg);
+
+extern minithread_t minithread_create_shared(proc_t proc, arg_t arg);
+
+/*
+ * int
+ * minithread_fork_batch(int n, proc_t* procs, arg_t* args,
+ *                       minithread_t* out_threads)
+ *	Fork n threads at once, thread i running procs[i](args[i]). Control
+ *	blocks the pool lacks come from one allocation, stacks the cache
+ *	lacks from one reservation, and the threads join the run queue
+ *	together, in order.
+ *	If out_threads is not NULL it receives the n new threads. Returns 0,
+ *	or -1 if the threads could not be created (none are).
+ */
+extern int minithread_fork_batch(int n, proc_t* procs, arg_t* args,
+				 minithread_t* out_threads);
+
+/*
+ * void minithread_tcb_on_stack(int enabled)
+ *	While enabled, threads created with a stack of their own keep their
+ *	control block at the top of that stack, right above the first frame,
+ *	instead of taking one from the control block pool. Either way the
+ *	control block is reclaimed when the thread exits, so a minithread_t
+ *	must not be used after its thread has finished.
+ */
+extern void minithread_tcb_on_stack(int enabled);
+
 
 
 /*
@@ -56,6 +118,12 @@ extern minithread_t minithread_self();
  */
 extern int minithread_id();
 
+/*
+ * int minithread_get_id(minithread_t t):
+ *      Return thread identifier of t.
+ */
+extern int minithread_get_id(minithread_t t);
+
 
 /*
  * minithread_stop()
@@ -76,6 +144,276 @@ extern void minithread_start(minithread_t t);
  */
 extern void minithread_yield();
 
+/*
+ * minithread_switch_to(minithread_t t)
+ *	Block the caller, like minithread_stop, and run t immediately
+ *	instead of the head of the ready queue. t must be runnable or
+ *	stopped without waiting on anything else (e.g. freshly created, or
+ *	just taken off a wait queue by the caller); it is removed from the
+ *	ready queue if it is on it. A request/response pair between two
+ *	threads that switch_to each other costs one context switch per hop
+ *	and no ready queue operations.
+ */
+extern void minithread_switch_to(minithread_t t);
+
+/*
+ * minithread_yield_to(minithread_t t)
+ *	Like minithread_yield, but the processor goes directly to t, which
+ *	must be runnable as for minithread_switch_to. The caller is put at
+ *	the end of the ready queue.
+ */
+extern void minithread_yield_to(minithread_t t);
+
+/*
+ * void* minithread_get_log_buffer(minithread_t t)
+ * minithread_set_log_buffer(minithread_t t, void* buffer)
+ *	The buffer t logs into (see klog.h), NULL until t first logs. It is
+ *	handed back to the log when t is reclaimed.
+ */
+extern void* minithread_get_log_buffer(minithread_t t);
+
+extern void minithread_set_log_buffer(minithread_t t, void* buffer);
+
+/*
+ * Stack profiling.
+ *
+ * int minithread_stack_profile(int mode)
+ *	STACK_PROFILE_MEASURE: stacks of threads created from now on are
+ *	painted, and when such a thread exits its peak stack depth is
+ *	recorded against the procedure it was started at.
+ *	STACK_PROFILE_TUNE: as MEASURE, and threads forked or created with
+ *	the default stack size get a stack sized from the peak depth seen
+ *	for their procedure (twice the peak plus a page of headroom) once a
+ *	few of its threads have been measured.
+ *	STACK_PROFILE_OFF: stop painting new stacks and use default sizes.
+ *	Painting touches every page of a stack, so leave profiling off in
+ *	runs that rely on lazily committed stacks. Returns 0, or -1 (the
+ *	mode unchanged) if profiling is turned on with more than one virtual
+ *	processor.
+ *
+ * minithread_stack_report()
+ *	Print the threads measured, peak depth and tuned stack size for
+ *	each procedure.
+ */
+#define STACK_PROFILE_OFF 0
+#define STACK_PROFILE_MEASURE 1
+#define STACK_PROFILE_TUNE 2
+
+extern int minithread_stack_profile(int mode);
+
+extern void minithread_stack_report();
+
+/*
+ * Scheduling statistics.
+ *
+ * minithread_get_stats(minithread_t t, minithread_stats_t* stats)
+ *	Fill in *stats with the time t has spent running, waiting on the
+ *	ready queue and blocked so far, and how often it has given up the
+ *	processor: voluntarily (yielding, blocking, exiting) or because it
+ *	was preempted, i.e. yielded from an interrupt handler. waits counts
+ *	the times it blocked in semaphore_P or minithread_stop.
+ *
+ * int minithread_get_all_stats(minithread_stats_t* stats, int max)
+ *	Snapshot the statistics of up to max live threads (the idle thread
+ *	included) into stats. Returns the number of entries filled in, at
+ *	most max.
+ *
+ * minithread_stats_report()
+ *	Print the statistics of the live threads (threads forked while it
+ *	runs may be left out).
+ *
+ * unsigned __int64 minithread_switch_count()
+ *	Number of context switches so far, by all threads.
+ */
+typedef struct minithread_stats {
+  int id;
+  unsigned __int64 run_us;
+  unsigned __int64 runnable_us;
+  unsigned __int64 blocked_us;
+  long voluntary_switches;
+  long involuntary_switches;
+  long waits;
+} minithread_stats_t;
+
+extern void minithread_get_stats(minithread_t t, minithread_stats_t* stats);
+
+extern int minithread_get_all_stats(minithread_stats_t* stats, int max);
+
+extern void minithread_stats_report();
+
+extern unsigned __int64 minithread_switch_count();
+
+/*
+ * Latency histograms, in nanoseconds (see histogram.h).
+ *
+ * histogram_t minithread_histogram(int which)
+ *	MINITHREAD_WAKEUP_LATENCY: for each thread made runnable by
+ *	minithread_start (so also by semaphore_V), the delay until it ran.
+ *	MINITHREAD_QUEUE_RESIDENCY: each stay of a thread on the ready
+ *	queue, whatever put it there.
+ *	The histograms may be reset between measurements.
+ *
+ * minithread_latency_report()
+ *	Print p50, p99, p999 and maximum of both histograms.
+ */
+#define MINITHREAD_WAKEUP_LATENCY 0
+#define MINITHREAD_QUEUE_RESIDENCY 1
+
+extern histogram_t minithread_histogram(int which);
+
+extern void minithread_latency_report();
+
+/*
+ * Hardware counter attribution (see perfcounters.h).
+ *
+ * int minithread_perf_counters(int enabled)
+ *	While enabled, every context switch reads the hardware counters, so
+ *	each thread accumulates the cycles, instructions, cache misses and
+ *	branch misses counted while it ran, and what the switches into it
+ *	cost. Returns the number of counters available, or -1 if there are
+ *	none or there is more than one virtual processor (counting stays
+ *	off). The first time it is enabled,
+ *	minithread_perf_report is registered to run at exit.
+ *
+ * minithread_perf_report()
+ *	Print, for every thread counted, live or reclaimed, its switches in,
+ *	its totals while running, and the average cost of a switch into it.
+ */
+extern int minithread_perf_counters(int enabled);
+
+extern void minithread_perf_report();
+
+/*
+ * minithread_clock_needed()
+ *	Have the clock tick from now on. The clock is only started for the
+ *	profiler, the statistics page and runaway detection, which call this,
+ *	so programs using none of them take no clock signals. Called before
+ *	the system starts, the clock starts with it; called from a thread on
+ *	a processor other than 0, processor 0 starts it at its next yield.
+ *	minithread_system_run stops the clock before it returns.
+ */
+extern void minithread_clock_needed();
+
+/*
+ * int minithread_stats_page(char* filename)
+ *	Publish the scheduler counters (ready queue length, live threads,
+ *	context switches and switches per second, exited threads awaiting
+ *	reclamation, dropped and deferred interrupts) in a statistics page
+ *	mapped from filename, updated on every clock tick taken. Other
+ *	processes can read it at any time (see statspage.h and statsmon.c).
+ *	Returns 0 on success, -1 on failure.
+ */
+extern int minithread_stats_page(char* filename);
+
+/*
+ * Runaway detection.
+ *
+ * int minithread_runaway_detect(int threshold)
+ *	Watch the clock ticks for threads monopolizing the processor:
+ *	MINITHREAD_RUNAWAY_RUNNING: the same thread (other than the idle
+ *	thread) stayed current, with no context switch, for threshold
+ *	consecutive ticks.
+ *	MINITHREAD_RUNAWAY_DISABLED: interrupts were disabled at threshold
+ *	consecutive ticks.
+ *	Each such stretch is recorded once, with the pc where it reached the
+ *	threshold, and its length in ticks kept up to date while it lasts.
+ *	Ticks come every PERIOD microseconds. A threshold of 0 stops the
+ *	detection; the records are kept. Returns 0, or -1 if the clock
+ *	cannot take another tick hook.
+ *
+ * int minithread_get_runaways(minithread_runaway_t* records, int max)
+ *	Copy up to max runaways recorded into records. Returns the number
+ *	recorded, which may be more than max.
+ *
+ * minithread_runaway_report()
+ *	Print the runaways recorded.
+ */
+#define MINITHREAD_RUNAWAY_RUNNING 0
+#define MINITHREAD_RUNAWAY_DISABLED 1
+
+typedef struct minithread_runaway {
+  int kind;
+  int thread;
+  proc_t proc;
+  void* pc;
+  long ticks;
+} minithread_runaway_t;
+
+extern int minithread_runaway_detect(int threshold);
+
+extern int minithread_get_runaways(minithread_runaway_t* records, int max);
+
+extern void minithread_runaway_report();
+
+/*
+ * Virtual processors.
+ *
+ * int minithread_processors(int n)
+ *	Run the threads on n virtual processors, each a host thread, rather
+ *	than on one; 0 selects one per host processor. Must be called before
+ *	minithread_system_initialize or minithread_system_run, whose caller
+ *	becomes processor 0. Each processor has a ready queue and an idle
+ *	thread of its own: a thread made runnable (forked, started, yielding)
+ *	goes on the queue of the processor that made it so, and processors
+ *	with nothing to run steal threads from the queues of the others.
+ *	Semaphores work across processors. Returns n, or -1 if n is more
+ *	than MINITHREAD_MAX_PROCESSORS, the system is already running, or n
+ *	is more than 1 while event tracing, hardware counters or stack
+ *	profiling is on.
+ *
+ *	With more than one processor:
+ *	only processor 0 takes clock interrupts, and disabling interrupts
+ *	does not keep the other processors out of anything;
+ *	minithread_fork_shared threads get a stack of their own;
+ *	minithread_switch_to and minithread_yield_to do nothing if t is
+ *	runnable on the queue of another processor;
+ *	the latency histograms, the profiler and runaway detection only see
+ *	processor 0; event tracing, hardware counters and stack profiling
+ *	cannot be turned on (eventtrace_start, minithread_perf_counters and
+ *	minithread_stack_profile return -1).
+ *
+ * int minithread_processor_id()
+ *	The processor the caller is running on, from 0. A thread may be on
+ *	another processor after any switch.
+ *
+ * int minithread_processor_count()
+ *	The number of virtual processors the system runs, or will run, on.
+ */
+#define MINITHREAD_MAX_PROCESSORS 64
+
+extern int minithread_processors(int n);
+
+extern int minithread_processor_id();
+
+extern int minithread_processor_count();
+
+/*
+ * Requests from foreign host threads.
+ *
+ * Host threads that are not virtual processors (I/O threads, library
+ * callbacks) must not call the rest of this interface, semaphores
+ * included. They can use these two, which never wait for the minithreads:
+ * the request goes on a lock-free queue, and the scheduler takes it off
+ * at the next switch on any processor, or in the idle loop. A processor
+ * running a thread that never switches does not see it until then.
+ *
+ * minithread_start_from_foreign(minithread_t t)
+ *	Like minithread_start. t must be a thread that stops to wait for
+ *	this start. The start takes effect once t has stopped, so it may be
+ *	made before t stops; if t exits instead, the start is dropped. A
+ *	second start made before the first takes effect has no further
+ *	effect.
+ *
+ * int minithread_fork_from_foreign(proc_t proc, arg_t arg)
+ *	Like minithread_fork, but the thread is created later, by the
+ *	scheduler, which forks a bounded number at each switch and retries
+ *	a fork that fails at a later one. Returns 0, or -1 if there is no
+ *	memory for the request.
+ */
+extern void minithread_start_from_foreign(minithread_t t);
+
+extern int minithread_fork_from_foreign(proc_t proc, arg_t arg);
+
 /*
  * minithread_system_initialize(proc_t mainproc, arg_t mainarg)
  *	Initialize the system to run the first minithread at
@@ -85,6 +423,36 @@ extern void minithread_yield();
  */
 extern void minithread_system_initialize(proc_t mainproc, arg_t mainarg);
 
+/*
+ * minithread_system_run(proc_t mainproc, arg_t mainarg,
+ *                       minithread_run_stats_t* stats)
+ *	Like minithread_system_initialize, but returns to the caller once
+ *	every thread other than the daemon threads has exited, the exited
+ *	threads have been reclaimed and nothing is left to run. If stats is
+ *	not NULL it is filled in with the threads created, the context
+ *	switches and the wall time of the run. On return the clock has been
+ *	stopped and interrupts are disabled, so the host program can go on
+ *	as if the minithreads had never run. A run whose threads all block
+ *	forever does not return. Returns 0, or -1 without running mainproc
+ *	if the system has been started before: the system runs once per
+ *	process, and minithread_system_initialize after a run aborts.
+ *
+ * minithread_daemon(minithread_t t)
+ *	Mark t as a daemon thread, one that serves the others and never
+ *	exits (such as the klog logger): minithread_system_run does not
+ *	wait for it.
+ */
+typedef struct minithread_run_stats {
+  long threads_created;
+  unsigned __int64 switches;
+  unsigned __int64 elapsed_us;
+} minithread_run_stats_t;
+
+extern int minithread_system_run(proc_t mainproc, arg_t mainarg,
+				 minithread_run_stats_t* stats);
+
+extern void minithread_daemon(minithread_t t);
+
 /*
  * You do not need to implement the following procedure for part 1 of
  * the assignment.  It is required for the preemptive version of the
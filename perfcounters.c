@@ -0,0 +1,118 @@
+/*
+ * Hardware performance counters; see perfcounters.h.
+ *
+ * The counters are opened as one perf event group, so a single read()
+ * returns all of them, measured over the same interval.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "perfcounters.h"
+
+char* perf_counter_names[PERF_COUNTERS] =
+  {"cycles", "instructions", "L1d misses", "LLC misses", "branch misses"};
+
+#ifdef __linux__
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* event of each counter */
+static struct {
+  unsigned int type;
+  unsigned long long config;
+} perf_events[PERF_COUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                       | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                       | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+
+static int group_fd = -1;
+static int fds[PERF_COUNTERS];
+static int opened;
+/* position in the group read of each counter, or -1 */
+static int slot[PERF_COUNTERS];
+
+int perfcounters_open() {
+  struct perf_event_attr attr;
+  int i;
+
+  if (group_fd != -1)
+    perfcounters_close();
+
+  opened = 0;
+  for (i = 0; i < PERF_COUNTERS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* this thread, any cpu; the first counter that opens leads the group */
+    fds[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+    if (fds[i] == -1) {
+      slot[i] = -1;
+      continue;
+    }
+    if (group_fd == -1)
+      group_fd = fds[i];
+    slot[i] = opened++;
+  }
+  return (opened == 0) ? -1 : opened;
+}
+
+int perfcounters_available(int i) {
+  return group_fd != -1 && slot[i] != -1;
+}
+
+int perfcounters_read(unsigned __int64* values) {
+  /* number of counters, then their values */
+  unsigned long long buffer[1 + PERF_COUNTERS];
+  int i;
+
+  if (group_fd == -1
+      || read(group_fd, buffer, sizeof(buffer)) < (ssize_t) ((1 + opened) * sizeof(buffer[0])))
+    return -1;
+  for (i = 0; i < PERF_COUNTERS; i++)
+    values[i] = (slot[i] == -1) ? 0 : buffer[1 + slot[i]];
+  return 0;
+}
+
+void perfcounters_close() {
+  int i;
+
+  for (i = 0; i < PERF_COUNTERS; i++)
+    if (fds[i] != -1 && fds[i] != group_fd)
+      close(fds[i]);
+  if (group_fd != -1)
+    close(group_fd);
+  group_fd = -1;
+}
+
+#else /* no counters */
+
+int perfcounters_open() {
+  return -1;
+}
+
+int perfcounters_available(int i) {
+  return 0;
+}
+
+int perfcounters_read(unsigned __int64* values) {
+  return -1;
+}
+
+void perfcounters_close() {
+}
+
+#endif
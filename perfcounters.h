@@ -0,0 +1,41 @@
+/*
+ * Hardware performance counters of the system thread.
+ *
+ * Counts cycles, instructions, L1 data cache misses, last level cache
+ * misses and branch mispredictions in user mode, with perf_event_open on
+ * Linux. Counters the processor (or a virtual machine) does not provide
+ * read as 0; elsewhere none are available.
+ */
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+#include "defs.h"
+
+#define PERF_COUNTERS 5
+
+/* short names of the counters, in the order they are read */
+extern char* perf_counter_names[PERF_COUNTERS];
+
+/*
+ * Start counting. Return the number of counters available, or -1 if
+ * there are none.
+ */
+extern int perfcounters_open();
+
+/*
+ * Is counter i (0 <= i < PERF_COUNTERS) available?
+ */
+extern int perfcounters_available(int i);
+
+/*
+ * Read all the counters at once into values. Return 0 (success) or -1
+ * (failure).
+ */
+extern int perfcounters_read(unsigned __int64* values);
+
+/*
+ * Stop counting.
+ */
+extern void perfcounters_close();
+
+#endif __PERFCOUNTERS_H__
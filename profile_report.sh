@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Symbolize the samples written by profiler_write (see profiler.h) into a
+# flat profile and a per-thread profile.
+#
+# usage: profile_report.sh minithreads profile.txt
+#
+# Needs nm; the executable must be the one that wrote the profile.
+
+if [ $# -ne 2 ]; then
+  echo "usage: $0 executable profile" >&2
+  exit 1
+fi
+
+symbols=`mktemp` || exit 1
+trap 'rm -f "$symbols"' 0
+
+nm -n --defined-only "$1" | awk '$2 ~ /^[tTwW]$/ { print $1, $3 }' > "$symbols"
+
+awk -v symbols="$symbols" '
+function hex(s,    i, v) {
+  s = tolower(s)
+  sub(/^0x/, "", s)
+  v = 0
+  for (i = 1; i <= length(s); i++)
+    v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+  return v
+}
+
+# name of the function containing address, by binary search
+function lookup(address,    lo, hi, mid) {
+  if (n == 0 || address < addr[0] || address > text_end)
+    return "[outside " executable "]"
+  lo = 0
+  hi = n - 1
+  while (lo < hi) {
+    mid = int((lo + hi + 1) / 2)
+    if (addr[mid] <= address)
+      lo = mid
+    else
+      hi = mid - 1
+  }
+  return name[lo]
+}
+
+BEGIN {
+  n = 0
+  while ((getline line < symbols) > 0) {
+    split(line, field, " ")
+    addr[n] = hex(field[1])
+    name[n] = field[2]
+    where[field[2]] = addr[n]
+    n++
+  }
+  text_end = (n > 0) ? addr[n - 1] + 65536 : 0
+  offset = 0
+  total = 0
+}
+
+/^# anchor / {
+  if ($3 in where)
+    offset = hex($4) - where[$3]
+  next
+}
+
+/^#/ { next }
+
+{
+  function_name = lookup(hex($2) - offset)
+  flat[function_name]++
+  per_thread[$1 " " function_name]++
+  thread_total[$1]++
+  total++
+}
+
+END {
+  if (total == 0) {
+    print "no samples"
+    exit
+  }
+  printf "flat profile (%d samples)\n", total
+  for (f in flat)
+    printf "%8d %6.2f%%  %s\n", flat[f], 100 * flat[f] / total, f | "sort -k1,1nr"
+  close("sort -k1,1nr")
+
+  printf "\nper-thread profile\n"
+  for (k in per_thread) {
+    split(k, field, " ")
+    printf "%8s %8d %6.2f%%  %s\n", field[1], per_thread[k],
+      100 * per_thread[k] / thread_total[field[1]], field[2] | "sort -k1,1n -k2,2nr"
+  }
+  close("sort -k1,1n -k2,2nr")
+}
+' executable="$1" "$2"
@@ -0,0 +1,69 @@
+/*
+ * Statistical profiler; see profiler.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "interrupts.h"
+#include "minithread.h"
+#include "profiler.h"
+
+typedef struct sample {
+  void* pc;
+  int thread;
+} sample_t;
+
+static sample_t* samples = NULL;
+static int max_samples;
+static volatile int sample_count;
+static volatile long missed;
+
+/* tick hook: runs in the clock device, so only stores */
+static void profiler_tick(void* pc, int taken) {
+  if (sample_count < max_samples) {
+    samples[sample_count].pc = pc;
+    samples[sample_count].thread = minithread_id();
+    sample_count++;
+  }
+  else
+    missed++;
+}
+
+int profiler_start(int capacity) {
+  minithread_clock_tick_unhook(profiler_tick);
+  if (capacity <= 0)
+    return -1;
+
+  free(samples);
+  samples = (sample_t*) malloc(capacity * sizeof(sample_t));
+  if (samples == NULL)
+    return -1;
+  max_samples = capacity;
+  sample_count = 0;
+  missed = 0;
+
+  minithread_clock_needed();
+  return minithread_clock_tick_hook(profiler_tick);
+}
+
+void profiler_stop() {
+  minithread_clock_tick_unhook(profiler_tick);
+}
+
+int profiler_write(char* filename) {
+  FILE* file;
+  int i;
+
+  if (samples == NULL || (file = fopen(filename, "w")) == NULL)
+    return -1;
+
+  /* profile_report.sh relocates the pcs by where this function ended up */
+  fprintf(file, "# minithreads profile: %d samples, %ld missed, period %d us\n",
+	  sample_count, missed, PERIOD);
+  fprintf(file, "# anchor profiler_write %p\n", (void *) profiler_write);
+  for (i = 0; i < sample_count; i++)
+    fprintf(file, "%d %p\n", samples[i].thread, samples[i].pc);
+
+  return (fclose(file) == 0) ? 0 : -1;
+}
@@ -0,0 +1,34 @@
+/*
+ * Statistical profiler.
+ *
+ * On every clock tick the profiler records where the system thread was
+ * (its program counter) and which minithread was running, into a buffer
+ * allocated up front. Ticks come every PERIOD microseconds; profiler_start
+ * starts the clock (see minithread_clock_needed). Samples are taken
+ * whether or not the tick could be delivered, so time spent in the C
+ * library or with interrupts disabled is profiled too.
+ *
+ * The samples are written out as text, one "thread pc" pair per line;
+ * profile_report.sh turns them into flat and per-thread profiles.
+ */
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+/*
+ * Start sampling into a buffer of max_samples samples, discarding any
+ * taken before. Once it is full further ticks are only counted. Return 0
+ * (success) or -1 (failure).
+ */
+extern int profiler_start(int max_samples);
+
+/*
+ * Stop sampling. The samples taken so far are kept.
+ */
+extern void profiler_stop();
+
+/*
+ * Write the samples to filename. Return 0 (success) or -1 (failure).
+ */
+extern int profiler_write(char* filename);
+
+#endif __PROFILER_H__
@@ -3,6 +3,7 @@
  *
  */
 #include "queue.h"
+#include "machineprimitives.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -18,6 +19,92 @@ struct queue {
 	int size;
 };
 
+/*
+ * List nodes are recycled through free lists shared by all queues rather
+ * than given back to malloc, so steady-state appends and dequeues do not
+ * allocate. queue_append_all allocates the nodes it is short of in one
+ * block; such nodes are never passed to free.
+ *
+ * Each host thread (each virtual processor, see minithread_processors)
+ * recycles through a free list of its own, without locking. One holding
+ * twice NODE_BATCH nodes passes a batch of them on to the depot, shared
+ * by all, and one that runs out takes a batch from there before turning
+ * to malloc, so nodes freed on one processor and needed on another are
+ * not lost to either.
+ */
+#define NODE_BATCH 64
+
+/* the free list of a host thread */
+typedef struct node_cache {
+	struct list_node* nodes;
+	int count;
+} node_cache_t;
+
+static THREAD_LOCAL node_cache_t node_cache = {NULL, 0};
+
+/* batches of NODE_BATCH nodes, chained through the prev of their first */
+static struct list_node* depot = NULL;
+static tas_lock_t depot_lock = 0;
+
+/* takes a batch from the depot, if it has one */
+static void node_refill(node_cache_t* cache) {
+	while (atomic_test_and_set(&depot_lock)) {
+		processor_relax();
+	}
+	cache->nodes = depot;
+	if (cache->nodes != NULL) {
+		depot = cache->nodes->prev;
+		cache->count = NODE_BATCH;
+	}
+	atomic_clear(&depot_lock);
+}
+
+/* passes the NODE_BATCH most recently freed nodes on to the depot */
+static void node_spill(node_cache_t* cache) {
+	struct list_node* first = cache->nodes;
+	struct list_node* last = first;
+	int i;
+
+	for (i = 1; i < NODE_BATCH; i++) {
+		last = last->next;
+	}
+	cache->nodes = last->next;
+	cache->count -= NODE_BATCH;
+	last->next = NULL;
+	while (atomic_test_and_set(&depot_lock)) {
+		processor_relax();
+	}
+	first->prev = depot;
+	depot = first;
+	atomic_clear(&depot_lock);
+}
+
+/* the address of node_cache is taken once: each access to it costs a segment override */
+static struct list_node* node_new() {
+	node_cache_t* cache = &node_cache;
+	struct list_node* node;
+
+	if (cache->nodes == NULL && depot != NULL) {
+		node_refill(cache);
+	}
+	node = cache->nodes;
+	if (node == NULL) {
+		return (struct list_node*) malloc(sizeof(struct list_node));
+	}
+	cache->nodes = node->next;
+	cache->count--;
+	return node;
+}
+
+static void node_free(struct list_node* node) {
+	node_cache_t* cache = &node_cache;
+
+	node->next = cache->nodes;
+	cache->nodes = node;
+	if (++cache->count == 2 * NODE_BATCH) {
+		node_spill(cache);
+	}
+}
 
 /*
  * Return an empty queue.
@@ -42,9 +129,9 @@ queue_t queue_new() {
  * 0 (success) or -1 (failure).
  */
 int queue_prepend(queue_t queue, void* item) {
-	struct list_node* node = (struct list_node*) malloc(sizeof(struct list_node));
+	struct list_node* node;
 
-	if(queue == NULL || node == NULL){
+	if(queue == NULL || (node = node_new()) == NULL){
 		return -1;
 	}
 
@@ -72,9 +159,9 @@ int queue_prepend(queue_t queue, void* item) {
  * 0 (success) or -1 (failure). 
  */
 int queue_append(queue_t queue, void* item) {
-	struct list_node* node = (struct list_node*) malloc(sizeof(struct list_node));
+	struct list_node* node;
 	
-	if(queue == NULL || node == NULL){
+	if(queue == NULL || (node = node_new()) == NULL){
 		return -1;
 	}
 
@@ -97,6 +184,67 @@ int queue_append(queue_t queue, void* item) {
 	return 0;
 }
 
+/*
+ * Append n void*s to a queue, in order, linking them in with a single
+ * splice. Return 0 (success) or -1 (failure, queue unchanged).
+ */
+int queue_append_all(queue_t queue, void** items, int n) {
+	struct list_node* block = NULL;
+	struct list_node* first = NULL;
+	struct list_node* last = NULL;
+	struct list_node* node;
+	int i;
+
+	if(queue == NULL || n < 0){
+		return -1;
+	}
+	if(n == 0){
+		return 0;
+	}
+
+	/*Build the chain from recycled nodes, then from one new block*/
+	for(i = 0; i < n; i++) {
+		if(node_cache.nodes != NULL) {
+			node = node_new();
+		} else {
+			if(block == NULL) {
+				block = (struct list_node*) malloc((n - i) * sizeof(struct list_node));
+				if(block == NULL) {
+					/*Give back the nodes taken so far*/
+					while(first != NULL) {
+						node = first->next;
+						node_free(first);
+						first = node;
+					}
+					return -1;
+				}
+			}
+			node = block++;
+		}
+		node->data = items[i];
+		node->next = NULL;
+		node->prev = last;
+		if(last == NULL) {
+			first = node;
+		} else {
+			last->next = node;
+		}
+		last = node;
+	}
+
+	/*Splice the chain onto the tail*/
+	first->prev = queue->tail;
+	if (queue->tail == NULL) {
+		queue->head = first;
+	} else {
+		queue->tail->next = first;
+	}
+	queue->tail = last;
+	queue->size += n;
+
+	return 0;
+}
+
 /*
  * Dequeue and return the first void* from the queue or NULL if queue
  * is empty.  Return 0 (success) or -1 (failure).
@@ -123,7 +271,7 @@ int queue_dequeue(queue_t queue, void** item) {
 	queue->head = temp->next;
 	queue->size--;
 	
-	free(temp);
+	node_free(temp);
 
 	return 0;
 }
@@ -160,18 +308,19 @@ int queue_iterate(queue_t queue, PFany f, void* item) {
  */
 int queue_free (queue_t queue) {
 	struct list_node* curr;
+	struct list_node* next;
 
 	if(queue == NULL){
 		return -1;
 	}
 
-	curr = queue->head->next;
-	/*Remove all elements from the queue until size is 0 (dequeue return -1)*/
+	curr = queue->head;
+	/*Recycle every node of the queue*/
 	while(curr != NULL){
-		free(curr->prev);
-		curr = curr->next;
+		next = curr->next;
+		node_free(curr);
+		curr = next;
 	}
-	free(queue->tail);
 
 	free(queue);
 	return 0;
@@ -205,22 +354,24 @@ int queue_delete(queue_t queue, void** item) {
 	while(node != NULL) {
 		if (node->data == *item) {
 
-			if(node == queue->head) {
-				node->next->prev = NULL;
+			if(node->prev == NULL) {
 				queue->head = node->next;
-			} else if(node == queue->tail) {
-				node->prev->next = NULL;
-				queue->tail = node->prev;
 			} else {
 				node->prev->next = node->next;
+			}
+
+			if(node->next == NULL) {
+				queue->tail = node->prev;
+			} else {
 				node->next->prev = node->prev;
 			}
 			
 			queue->size--;
 
-			free(node);
+			node_free(node);
 			return 0;
 		}
+		node = node->next;
 	}
 	return -1;
 }
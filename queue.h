@@ -34,6 +34,13 @@ extern int queue_prepend(queue_t, void*);
  */
 extern int queue_append(queue_t, void*);
 
+/*
+ * Appends n void*s from an array to a queue (both specified as
+ * parameters), in array order, as one operation. Return 0 (success) or
+ * -1 (failure, in which case the queue is unchanged).
+ */
+extern int queue_append_all(queue_t, void**, int);
+
 /*
  * Dequeue and return the first void* from the queue. Return 0
  * (success) and first item if queue is nonempty, or -1 (failure) and
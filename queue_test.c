@@ -1,6 +1,9 @@
 #include "queue.h"
 #include <stdlib.h>
 #include <stdio.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 int add(void* data1, void* data2) {
 	int* val1 = (int*) data1;
@@ -10,11 +13,61 @@ int add(void* data1, void* data2) {
 	return 0;
 }
 
+/*
+ * queue_append_all: nothing to append, more items than there are recycled
+ * nodes, and the allocation of the missing nodes failing.
+ */
+void test_append_all() {
+	queue_t q = queue_new();
+	int values[64];
+	void* items[64];
+	void* item;
+	int result, i;
+#ifndef _WIN32
+	struct rlimit limit;
+#endif
+
+	for (i = 0; i < 64; i++) {
+		values[i] = i;
+		items[i] = &values[i];
+	}
+
+	result = queue_append_all(q, items, 0);
+	printf("append none: %d, length %d \n", result, queue_length(q));
+
+	/* a few nodes to recycle, then more items than that */
+	queue_append_all(q, items, 3);
+	while (queue_dequeue(q, &item) == 0)
+		;
+	result = queue_append_all(q, items, 10);
+	printf("append 10 with 3 recycled nodes: %d, length %d \n", result, queue_length(q));
+	for (i = 0; queue_dequeue(q, &item) == 0; i++) {
+		if (*(int*) item != i) {
+			printf("append 10: item %d is %d \n", i, *(int*) item);
+		}
+	}
+	printf("append 10: dequeued %d \n", i);
+
+	/* the missing nodes cannot be allocated: at most the 10 recycled
+	   ones are taken, so items need only cover those */
+#ifndef _WIN32
+	getrlimit(RLIMIT_AS, &limit);
+	limit.rlim_cur = 1024L * 1024 * 1024;
+	setrlimit(RLIMIT_AS, &limit);
+#endif
+	queue_append(q, items[0]);
+	result = queue_append_all(q, items, 0x7fffffff);
+	printf("append too many: %d, length %d \n", result, queue_length(q));
+	result = queue_append_all(q, items, 64);
+	printf("append 64 after failure: %d, length %d \n", result, queue_length(q));
+	queue_free(q);
+}
+
 main() {
 	queue_t q = queue_new();
 	int a = 1, b = 2, c = 3, d = 4, e = 5;
 	int result = 0;
-	void** data;
+	void* data;
 	printf("before append \n");
 	result = queue_append(q, &a);
 	printf("added element 1: %d \n", result);
@@ -27,13 +80,15 @@ main() {
 	result = queue_append(q, &e);
 	printf("added element 5: %d \n", result);
 
-	result = queue_dequeue(q, data);
+	result = queue_dequeue(q, &data);
 	printf("removed element 5: %d \n", result);
 	result = queue_length(q);
 	printf("length of queue: %d \n", result);
 	
-	result = queue_delete(q, data);
+	result = queue_delete(q, &data);
 	printf("remove item that does not exist: %d \n", result);
 
 	result = queue_iterate(q, &add, &b);
+
+	test_append_all();
 }
@@ -0,0 +1,400 @@
+/* schedbench.c
+
+   Scheduler microbenchmarks: the cost of the basic operations, each timed
+   over a number of iterations, after warmup runs, for several repetitions.
+   Results go to stderr (or the -o file) as CSV or JSON, one record per
+   benchmark, so runs can be compared release to release.
+
+   usage: schedbench [-f csv|json] [-w warmup] [-r reps] [-n iterations]
+                     [-o file] [benchmark ...]
+
+   With no benchmarks named, all of them are run. -n overrides the
+   iteration count of every benchmark.
+*/
+
+#include "minithread.h"
+#include "synch.h"
+#include "queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* threads contending for one semaphore in "pv_contended" */
+#define CONTENDERS 4
+
+/* most threads "fork_exit" has alive at once (each holds a stack mapping) */
+#define FORK_BATCH 1000
+
+/*
+ * A benchmark performs about n operations and returns how many it did.
+ */
+typedef long (*bench_proc_t)(long n);
+
+typedef struct {
+  char* name;
+  char* unit;          /* what one operation is */
+  bench_proc_t proc;
+  long iterations;     /* default n */
+} bench_t;
+
+/* per benchmark results, in nanoseconds per operation */
+typedef struct {
+  long ops;
+  double min;
+  double median;
+  double mean;
+  double max;
+} result_t;
+
+int warmup = 1;
+int reps = 5;
+long iterations = 0;
+int json = 0;
+FILE* out;
+
+semaphore_t done;
+
+/* raw switch: two contexts with no scheduler in between */
+stack_pointer_t bench_sp;
+stack_pointer_t partner_base;
+stack_pointer_t partner_sp;
+
+int switch_partner(int* arg) {
+  for (;;)
+    minithread_switch(&partner_sp, &bench_sp);
+  return 0;
+}
+
+long bench_switch(long n) {
+  long i;
+
+  if (partner_base == NULL) {
+    minithread_allocate_stack(&partner_base, &partner_sp);
+    minithread_initialize_stack(&partner_sp, switch_partner, NULL, switch_partner, NULL);
+  }
+  for (i = 0; i < n; i++)
+    minithread_switch(&bench_sp, &partner_sp);
+  return 2 * n;
+}
+
+/* yield ping-pong: two threads alone on the ready queue */
+int yielder(int* arg) {
+  long n = *(long *) arg;
+  long i;
+
+  for (i = 0; i < n; i++)
+    minithread_yield();
+  semaphore_V(done);
+  return 0;
+}
+
+long bench_yield(long n) {
+  long each = n / 2;
+
+  minithread_fork(yielder, (int *) &each);
+  minithread_fork(yielder, (int *) &each);
+  semaphore_P(done);
+  semaphore_P(done);
+  return 2 * each;
+}
+
+/* semaphore ping-pong: the test3.c pattern */
+semaphore_t ping;
+semaphore_t pong;
+
+int ponger(int* arg) {
+  long n = *(long *) arg;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    semaphore_P(ping);
+    semaphore_V(pong);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+long bench_pingpong(long n) {
+  long i;
+
+  minithread_fork(ponger, (int *) &n);
+  for (i = 0; i < n; i++) {
+    semaphore_V(ping);
+    semaphore_P(pong);
+  }
+  semaphore_P(done);
+  return n;
+}
+
+/* directed handoff: the pingpong round trip with minithread_switch_to,
+   which costs one switch per hop and no ready queue operations */
+minithread_t handoff_main;
+minithread_t handoff_partner;
+
+int handoff_proc(int* arg) {
+  long n = *(long *) arg;
+  long i;
+
+  for (i = 0; i < n; i++)
+    minithread_switch_to(handoff_main);
+  semaphore_V(done);
+  return 0;
+}
+
+long bench_handoff(long n) {
+  unsigned __int64 switches = minithread_switch_count();
+  long i;
+
+  handoff_main = minithread_self();
+  handoff_partner = minithread_create(handoff_proc, (int *) &n);
+  if (handoff_partner == NULL) {
+    fprintf(stderr, "schedbench: fork failed\n");
+    exit(1);
+  }
+  for (i = 0; i < n; i++)
+    minithread_switch_to(handoff_partner);
+  switches = minithread_switch_count() - switches;
+  /* the partner is stopped in its last switch_to: let it finish */
+  minithread_start(handoff_partner);
+  semaphore_P(done);
+  if (switches != 2 * n) {
+    fprintf(stderr, "schedbench: handoff took %llu switches for %ld round trips\n",
+	    (unsigned long long) switches, n);
+    exit(1);
+  }
+  return n;
+}
+
+/* fork and exit: threads that only signal they ran */
+int signaller(int* arg) {
+  semaphore_V(done);
+  return 0;
+}
+
+long bench_fork(long n) {
+  long forked = 0;
+  long batch;
+  long i;
+
+  while (forked < n) {
+    batch = (n - forked < FORK_BATCH) ? n - forked : FORK_BATCH;
+    for (i = 0; i < batch; i++)
+      if (minithread_fork(signaller, NULL) == NULL) {
+	fprintf(stderr, "schedbench: fork failed\n");
+	exit(1);
+      }
+    for (i = 0; i < batch; i++)
+      semaphore_P(done);
+    forked += batch;
+  }
+  return n;
+}
+
+/* queue: append then dequeue, one item in the queue at a time */
+long bench_queue(long n) {
+  queue_t queue = queue_new();
+  void* item;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    queue_append(queue, (void *) &i);
+    queue_dequeue(queue, &item);
+  }
+  queue_free(queue);
+  return n;
+}
+
+/* uncontended P/V: a lock nobody else wants */
+long bench_pv(long n) {
+  semaphore_t lock = semaphore_create();
+  long i;
+
+  semaphore_initialize(lock, 1);
+  for (i = 0; i < n; i++) {
+    semaphore_P(lock);
+    semaphore_V(lock);
+  }
+  semaphore_destroy(lock);
+  return n;
+}
+
+/* contended P/V: threads yield while holding a shared lock */
+semaphore_t shared_lock;
+
+int contender(int* arg) {
+  long n = *(long *) arg;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    semaphore_P(shared_lock);
+    minithread_yield();
+    semaphore_V(shared_lock);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+long bench_pv_contended(long n) {
+  long each = n / CONTENDERS;
+  int i;
+
+  for (i = 0; i < CONTENDERS; i++)
+    minithread_fork(contender, (int *) &each);
+  for (i = 0; i < CONTENDERS; i++)
+    semaphore_P(done);
+  return CONTENDERS * each;
+}
+
+bench_t benches[] = {
+  {"switch", "switch", bench_switch, 1000000},
+  {"yield", "yield", bench_yield, 1000000},
+  {"pingpong", "round trip", bench_pingpong, 500000},
+  {"handoff", "round trip", bench_handoff, 500000},
+  {"fork_exit", "thread", bench_fork, 20000},
+  {"queue", "append+dequeue", bench_queue, 10000000},
+  {"pv", "P+V", bench_pv, 10000000},
+  {"pv_contended", "P+V", bench_pv_contended, 500000}
+};
+
+#define BENCHES ((int) (sizeof(benches) / sizeof(benches[0])))
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(double *) a;
+  double y = *(double *) b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+void measure(bench_t* bench, result_t* result) {
+  double ns_per_cycle = 1e9 / cyclesPerSecond();
+  long n = (iterations > 0) ? iterations : bench->iterations;
+  double* samples = (double *) malloc(reps * sizeof(double));
+  unsigned __int64 begin;
+  double sum = 0;
+  long ops = 0;
+  int i;
+
+  if (samples == NULL) {
+    fprintf(stderr, "schedbench: out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < warmup; i++)
+    bench->proc(n);
+  for (i = 0; i < reps; i++) {
+    begin = currentTimeCycles();
+    ops = bench->proc(n);
+    samples[i] = (currentTimeCycles() - begin) * ns_per_cycle / ops;
+    sum += samples[i];
+  }
+  qsort(samples, reps, sizeof(double), compare_doubles);
+
+  result->ops = ops;
+  result->min = samples[0];
+  result->median = (reps % 2) ? samples[reps / 2]
+    : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+  result->mean = sum / reps;
+  result->max = samples[reps - 1];
+  free(samples);
+}
+
+void report(bench_t* bench, result_t* result, int first) {
+  if (json)
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %ld, "
+	    "\"min_ns\": %.2f, \"median_ns\": %.2f, \"mean_ns\": %.2f, "
+	    "\"max_ns\": %.2f, \"ops_per_sec\": %.0f}",
+	    first ? "" : ",", bench->name, bench->unit, result->ops,
+	    result->min, result->median, result->mean, result->max,
+	    1e9 / result->median);
+  else
+    fprintf(out, "%s,%s,%ld,%.2f,%.2f,%.2f,%.2f,%.0f\n",
+	    bench->name, bench->unit, result->ops, result->min, result->median,
+	    result->mean, result->max, 1e9 / result->median);
+  fflush(out);
+}
+
+char** selected;
+int selected_count;
+
+int run(int* arg) {
+  result_t result;
+  int first = 1;
+  int i, j;
+
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  ping = semaphore_create();
+  semaphore_initialize(ping, 0);
+  pong = semaphore_create();
+  semaphore_initialize(pong, 0);
+  shared_lock = semaphore_create();
+  semaphore_initialize(shared_lock, 1);
+
+  if (json)
+    fprintf(out, "{\"warmup\": %d, \"reps\": %d, \"benchmarks\": [", warmup, reps);
+  else
+    fprintf(out, "name,unit,ops,min_ns,median_ns,mean_ns,max_ns,ops_per_sec\n");
+
+  for (i = 0; i < BENCHES; i++) {
+    if (selected_count > 0) {
+      for (j = 0; j < selected_count; j++)
+	if (strcmp(selected[j], benches[i].name) == 0)
+	  break;
+      if (j == selected_count)
+	continue;
+    }
+    measure(&benches[i], &result);
+    report(&benches[i], &result, first);
+    first = 0;
+  }
+
+  if (json)
+    fprintf(out, "\n]}\n");
+  return 0;
+}
+
+void usage(char* program) {
+  int i;
+
+  fprintf(stderr, "usage: %s [-f csv|json] [-w warmup] [-r reps] [-n iterations] "
+	  "[-o file] [benchmark ...]\nbenchmarks:", program);
+  for (i = 0; i < BENCHES; i++)
+    fprintf(stderr, " %s", benches[i].name);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int i;
+
+  out = stderr;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (i + 1 == argc)
+      usage(argv[0]);
+    if (strcmp(argv[i], "-f") == 0)
+      json = (strcmp(argv[++i], "json") == 0);
+    else if (strcmp(argv[i], "-w") == 0)
+      warmup = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0)
+      reps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0)
+      iterations = atol(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0) {
+      out = fopen(argv[++i], "w");
+      if (out == NULL) {
+	perror(argv[i]);
+	return 1;
+      }
+    }
+    else
+      usage(argv[0]);
+  }
+  if (warmup < 0 || reps <= 0)
+    usage(argv[0]);
+  selected = argv + i;
+  selected_count = argc - i;
+
+  minithread_system_run(run, NULL, NULL);
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,91 @@
+/* sharedstack_bench.c
+
+   Compare shared-stack threads with ordinary threads: PAIRS pairs of
+   threads ping-pong ROUNDS times through two semaphores each (the test3.c
+   pattern), first on dedicated stacks and then on the shared stack.
+   Results go to stderr, so run with the scheduler's output redirected.
+*/
+
+#include "minithread.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAIRS 1000
+#define ROUNDS 100
+
+typedef struct {
+  semaphore_t ping;
+  semaphore_t pong;
+} pair_t;
+
+pair_t pairs[PAIRS];
+semaphore_t done;
+
+int pinger(int* arg) {
+  pair_t* p = (pair_t *) arg;
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    semaphore_V(p->ping);
+    semaphore_P(p->pong);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int ponger(int* arg) {
+  pair_t* p = (pair_t *) arg;
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    semaphore_P(p->ping);
+    semaphore_V(p->pong);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+void run(char* name, minithread_t (*fork)(proc_t, arg_t)) {
+  unsigned __int64 begin, elapsed;
+  int i;
+
+  for (i = 0; i < PAIRS; i++) {
+    semaphore_initialize(pairs[i].ping, 0);
+    semaphore_initialize(pairs[i].pong, 0);
+  }
+
+  begin = currentTimeMillis();
+  for (i = 0; i < PAIRS; i++) {
+    fork(pinger, (int *) &pairs[i]);
+    fork(ponger, (int *) &pairs[i]);
+  }
+  for (i = 0; i < 2 * PAIRS; i++)
+    semaphore_P(done);
+  elapsed = currentTimeMillis() - begin;
+
+  fprintf(stderr, "%-10s %d threads, %d round trips each: %lu ms\n",
+	  name, 2 * PAIRS, ROUNDS, (unsigned long) elapsed);
+}
+
+int bench(int* arg) {
+  int i;
+
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  for (i = 0; i < PAIRS; i++) {
+    pairs[i].ping = semaphore_create();
+    pairs[i].pong = semaphore_create();
+  }
+
+  run("dedicated", minithread_fork);
+  run("shared", minithread_fork_shared);
+
+  exit(0);
+  return 0;
+}
+
+main() {
+  minithread_system_initialize(bench, NULL);
+}
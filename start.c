@@ -14,9 +14,16 @@ unsigned int start(void) {
 unsigned long start(void) {  
 #elif defined(_M_AMD64)
 unsigned __int64 start(void) {  
+#elif defined(__x86_64__)
+unsigned long start(void) {  
 #else
 #error "Arch not supported?"
 #endif
+#if defined(__x86_64__) && !defined(_WIN64)
+  /* glibc mangles the pc saved in a jmp_buf, so use a label address instead */
+here:
+  return (unsigned long) &&here;
+#else
   jmp_buf buf;
 
   setjmp(buf);
@@ -34,4 +41,5 @@ unsigned __int64 start(void) {
 #error "Arch not supported?"
 #endif
 #endif
+#endif
 }
@@ -0,0 +1,64 @@
+/*
+ * statsmon: watch the live statistics page of a minithreads process (see
+ * statspage.h).
+ *
+ * usage: statsmon statsfile [interval_ms]
+ *
+ * Prints one line of counters per interval (default 1000 ms) until the
+ * process is interrupted. The watched process is never stopped or
+ * signalled: the page is only read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "statspage.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define sleep_ms(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#define sleep_ms(ms) usleep((ms) * 1000)
+#endif
+
+/* print the column headings every this many lines */
+#define HEADER_LINES 20
+
+int main(int argc, char** argv) {
+  statspage_t* page;
+  statspage_t copy;
+  int interval = 1000;
+  int lines = 0;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s statsfile [interval_ms]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 3)
+    interval = atoi(argv[2]);
+
+  page = statspage_attach(argv[1]);
+  if (page == NULL) {
+    fprintf(stderr, "%s: %s is not a version %d statistics page\n",
+	    argv[0], argv[1], STATSPAGE_VERSION);
+    return 1;
+  }
+
+  for (;;) {
+    if (lines++ % HEADER_LINES == 0)
+      printf("%8s %10s %8s %8s %8s %12s %10s %8s %8s\n", "pid", "uptime ms",
+	     "runnable", "threads", "backlog", "switches", "switch/s",
+	     "dropped", "deferred");
+    if (statspage_snapshot(page, &copy) == -1)
+      printf("%8u (page busy)\n", page->pid);
+    else
+      printf("%8u %10llu %8llu %8llu %8llu %12llu %10llu %8llu %8llu\n",
+	     copy.pid, copy.uptime_us / 1000, copy.runnable, copy.threads,
+	     copy.dead_backlog, copy.switches, copy.switches_per_sec,
+	     copy.interrupts_dropped, copy.interrupts_deferred);
+    fflush(stdout);
+    sleep_ms(interval);
+  }
+  return 0;
+}
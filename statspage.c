@@ -0,0 +1,130 @@
+/*
+ * Live statistics page; see statspage.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "statspage.h"
+
+/* snapshot attempts before a reader gives up on a busy writer */
+#define SNAPSHOT_TRIES 1000
+
+/* orders the sequence number against the counters, for writer and reader */
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BARRIER() _ReadWriteBarrier()
+#else
+#define BARRIER() __sync_synchronize()
+#endif
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+static statspage_t* statspage_map(char* filename, int writable) {
+  HANDLE file;
+  HANDLE mapping;
+  void* page;
+
+  file = CreateFile(filename, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		    FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		    writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return NULL;
+  mapping = CreateFileMapping(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+			      0, sizeof(statspage_t), NULL);
+  CloseHandle(file);
+  if (mapping == NULL)
+    return NULL;
+  page = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+		       0, 0, sizeof(statspage_t));
+  CloseHandle(mapping);
+  return (statspage_t*) page;
+}
+
+static unsigned int statspage_pid() {
+  return (unsigned int) GetCurrentProcessId();
+}
+
+#else /* POSIX */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static statspage_t* statspage_map(char* filename, int writable) {
+  struct stat status;
+  void* page;
+  int fd;
+
+  fd = open(filename, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+  if (fd == -1)
+    return NULL;
+  if (writable ? ftruncate(fd, sizeof(statspage_t)) == -1
+      : (fstat(fd, &status) == -1 || status.st_size < (off_t) sizeof(statspage_t))) {
+    close(fd);
+    return NULL;
+  }
+  page = mmap(NULL, sizeof(statspage_t), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	      MAP_SHARED, fd, 0);
+  close(fd);
+  return (page == MAP_FAILED) ? NULL : (statspage_t*) page;
+}
+
+static unsigned int statspage_pid() {
+  return (unsigned int) getpid();
+}
+
+#endif
+
+statspage_t* statspage_create(char* filename) {
+  statspage_t* page = statspage_map(filename, 1);
+
+  if (page == NULL)
+    return NULL;
+  memset(page, 0, sizeof(statspage_t));
+  page->version = STATSPAGE_VERSION;
+  page->size = sizeof(statspage_t);
+  page->pid = statspage_pid();
+  /* a reader that sees the magic number sees an initialized page */
+  BARRIER();
+  page->magic = STATSPAGE_MAGIC;
+  return page;
+}
+
+statspage_t* statspage_attach(char* filename) {
+  statspage_t* page = statspage_map(filename, 0);
+
+  if (page == NULL)
+    return NULL;
+  if (page->magic != STATSPAGE_MAGIC || page->version != STATSPAGE_VERSION)
+    return NULL;
+  return page;
+}
+
+void statspage_begin(statspage_t* page) {
+  page->sequence++;
+  BARRIER();
+}
+
+void statspage_end(statspage_t* page) {
+  BARRIER();
+  page->sequence++;
+}
+
+int statspage_snapshot(statspage_t* page, statspage_t* copy) {
+  unsigned int sequence;
+  int tries;
+
+  for (tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+    sequence = page->sequence;
+    BARRIER();
+    memcpy(copy, (void*) page, sizeof(statspage_t));
+    BARRIER();
+    if ((sequence & 1) == 0 && page->sequence == sequence)
+      return 0;
+  }
+  return -1;
+}
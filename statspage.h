@@ -0,0 +1,71 @@
+/*
+ * Live statistics page.
+ *
+ * The scheduler publishes its counters into a small file mapped into
+ * memory, so a monitor in another process can map the same file and read
+ * them at any time, without a call into (or a stop of) the process being
+ * watched.
+ *
+ * Updates are protected by a sequence lock: the writer makes sequence
+ * odd, stores the counters, then makes it even again. A reader copies the
+ * page and keeps the copy only if sequence was even and unchanged around
+ * the copy. Readers never write, so they cannot hold the writer up.
+ *
+ * The layout is fixed-size and versioned: readers must check magic and
+ * version, and fields are only ever added at the end (with size telling
+ * how much of the page the writer filled in).
+ */
+#ifndef __STATSPAGE_H__
+#define __STATSPAGE_H__
+
+#include "defs.h"
+
+#define STATSPAGE_MAGIC 0x4d544853    /* "SHTM" */
+#define STATSPAGE_VERSION 1
+
+typedef struct statspage {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int size;                  /* sizeof(statspage_t) of the writer */
+  volatile unsigned int sequence;     /* odd while an update is in progress */
+  unsigned int pid;
+  unsigned int period_us;             /* how often the page is updated */
+  unsigned __int64 updates;
+  unsigned __int64 uptime_us;         /* since the page was created */
+  unsigned __int64 ticks;             /* clock interrupts taken */
+  unsigned __int64 runnable;          /* threads on the ready queue */
+  unsigned __int64 threads;           /* live threads, the idle thread included */
+  unsigned __int64 dead_backlog;      /* exited threads not yet reclaimed */
+  unsigned __int64 switches;          /* context switches so far */
+  unsigned __int64 switches_per_sec;  /* over the last update period */
+  unsigned __int64 interrupts_dropped;
+  unsigned __int64 interrupts_deferred;
+} statspage_t;
+
+/*
+ * Create (or truncate) filename, map it and return the page, initialized
+ * with no counts. Return NULL on failure.
+ */
+extern statspage_t* statspage_create(char* filename);
+
+/*
+ * Map the page of filename read-only, for monitoring. Return NULL on
+ * failure, or if the file does not hold a page of this version.
+ */
+extern statspage_t* statspage_attach(char* filename);
+
+/*
+ * Bracket an update of the counters by the (single) writer.
+ */
+extern void statspage_begin(statspage_t* page);
+
+extern void statspage_end(statspage_t* page);
+
+/*
+ * Copy a consistent snapshot of page into copy, retrying while an update
+ * is in progress. Return 0 (success) or -1 if no consistent copy could be
+ * taken in a reasonable number of tries.
+ */
+extern int statspage_snapshot(statspage_t* page, statspage_t* copy);
+
+#endif __STATSPAGE_H__
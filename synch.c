@@ -2,11 +2,13 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "defs.h"
 #include "synch.h"
 #include "queue.h"
 #include "minithread.h"
+#include "eventtrace.h"
 
 /*
  *	You must implement the procedures and types defined in this interface.
@@ -14,14 +16,42 @@
 
 
 /*
- * Semaphores.
+ * Semaphores. One created while profiling is on is on the semaphores list
+ * (chained through prev/next, listed set) until it is destroyed, so that
+ * the report can find it; the counters after the list links are only kept
+ * while profiling. Others never touch the list or its lock.
  */
 struct semaphore {
     int limit;
 	tas_lock_t mutex;
 	queue_t waiting;
+	char* name;
+	int listed;
+	struct semaphore* prev;
+	struct semaphore* next;
+	long pcalls;
+	long pblocked;
+	long spins;
+	int peakwaiters;
+	unsigned __int64 blockedcycles;
+	unsigned __int64 maxblockedcycles;
 };
 
+/*The live semaphores created while profiling, and the lock guarding the list*/
+semaphore_t semaphores = NULL;
+tas_lock_t semaphores_lock = 0;
+
+/*Whether semaphores keep their contention counters*/
+int semaphore_profiling = 0;
+
+static void lock_semaphores(){
+	long spins = 0;
+
+	while(atomic_test_and_set(&semaphores_lock)){
+		spin_wait(++spins);
+	}
+}
+
 
 /*
  * semaphore_t semaphore_create()
@@ -29,6 +59,22 @@ struct semaphore {
  */
 semaphore_t semaphore_create() {
 	semaphore_t sem = (semaphore_t) malloc(sizeof(struct semaphore));
+
+	if(sem == NULL){
+		return NULL;
+	}
+	memset(sem, 0, sizeof(struct semaphore));
+	if(!semaphore_profiling){
+		return sem;
+	}
+	sem->listed = 1;
+	lock_semaphores();
+	sem->next = semaphores;
+	if(semaphores != NULL){
+		semaphores->prev = sem;
+	}
+	semaphores = sem;
+	atomic_clear(&semaphores_lock);
 	return sem;
 }
 
@@ -37,7 +83,21 @@ semaphore_t semaphore_create() {
  *	Deallocate a semaphore.
  */
 void semaphore_destroy(semaphore_t sem) {
+	if(sem->listed){
+		lock_semaphores();
+		if(sem->prev != NULL){
+			sem->prev->next = sem->next;
+		}
+		else{
+			semaphores = sem->next;
+		}
+		if(sem->next != NULL){
+			sem->next->prev = sem->prev;
+		}
+		atomic_clear(&semaphores_lock);
+	}
 	queue_free(sem->waiting);
+	free(sem->name);
 	free(sem);
 }
 
@@ -59,13 +119,43 @@ void semaphore_initialize(semaphore_t sem, int cnt) {
  *	Wait on the semaphore.
  */
 void semaphore_P(semaphore_t sem) {
-	while(atomic_test_and_set(&(sem->mutex)));
+	unsigned __int64 blocked = 0;
+	long spins = 0;
+
+	while(atomic_test_and_set(&(sem->mutex))){
+		spin_wait(++spins);
+	}
+	if (semaphore_profiling) {
+		sem->pcalls++;
+		sem->spins += spins;
+	}
 	if (--sem->limit < 0) {
 		queue_append(sem->waiting, minithread_self());
-		sem->mutex = 0;
-		minithread_stop();
+		EVENT_TRACE(EVENT_BLOCK, minithread_id(), -1, sem);
+		if (semaphore_profiling) {
+			sem->pblocked++;
+			if (queue_length(sem->waiting) > sem->peakwaiters) {
+				sem->peakwaiters = queue_length(sem->waiting);
+			}
+			blocked = currentTimeCycles();
+		}
+		/*Blocking and letting go of the semaphore are one step: a V from another processor must find the thread stopped*/
+		minithread_unlock_and_stop(&(sem->mutex));
+		/*Charge the time blocked, under the lock again since other waiters do the same*/
+		if (blocked != 0) {
+			blocked = currentTimeCycles() - blocked;
+			spins = 0;
+			while(atomic_test_and_set(&(sem->mutex))){
+				spin_wait(++spins);
+			}
+			sem->blockedcycles += blocked;
+			if (blocked > sem->maxblockedcycles) {
+				sem->maxblockedcycles = blocked;
+			}
+			atomic_clear(&(sem->mutex));
+		}
 	} else {
-		sem->mutex = 0;
+		atomic_clear(&(sem->mutex));
 	}
 }
 /*
@@ -74,11 +164,111 @@ void semaphore_P(semaphore_t sem) {
  */
 void semaphore_V(semaphore_t sem) {
 	minithread_t thread;
-	while(atomic_test_and_set(&(sem->mutex)));
+	long spins = 0;
+
+	while(atomic_test_and_set(&(sem->mutex))){
+		spin_wait(++spins);
+	}
+	if (semaphore_profiling) {
+		sem->spins += spins;
+	}
 	
 	if(++sem->limit <= 0) {
 		queue_dequeue(sem->waiting,(void**) &thread);
+		EVENT_TRACE(EVENT_WAKEUP, minithread_id(), minithread_get_id(thread), sem);
 		minithread_start((minithread_t) thread);			 
 	}
-	sem->mutex = 0;
+	atomic_clear(&(sem->mutex));
+}
+
+void semaphore_set_name(semaphore_t sem, char* name) {
+	char* copy = (char*) malloc(strlen(name) + 1);
+
+	if (copy == NULL) {
+		return;
+	}
+	strcpy(copy, name);
+	free(sem->name);
+	sem->name = copy;
+}
+
+void semaphore_profile(int enabled) {
+	semaphore_profiling = enabled;
+}
+
+/*A semaphore's counters as the report found them, kept apart from it since it may be destroyed meanwhile*/
+typedef struct semaphore_sample {
+	char name[32];
+	long pcalls;
+	long pblocked;
+	long spins;
+	int peakwaiters;
+	unsigned __int64 blockedcycles;
+	unsigned __int64 maxblockedcycles;
+} semaphore_sample_t;
+
+/*Order semaphores by time blocked, then blocked P calls, then spins, hottest first*/
+static int semaphore_hotter(const void* a, const void* b) {
+	const semaphore_sample_t* x = (const semaphore_sample_t*) a;
+	const semaphore_sample_t* y = (const semaphore_sample_t*) b;
+
+	if (x->blockedcycles != y->blockedcycles) {
+		return (x->blockedcycles > y->blockedcycles) ? -1 : 1;
+	}
+	if (x->pblocked != y->pblocked) {
+		return (x->pblocked > y->pblocked) ? -1 : 1;
+	}
+	if (x->spins != y->spins) {
+		return (x->spins > y->spins) ? -1 : 1;
+	}
+	return 0;
+}
+
+void semaphore_report(int max) {
+	double cycles_per_us = (double) cyclesPerSecond() / 1000000;
+	semaphore_sample_t* ranked;
+	semaphore_sample_t* sample;
+	semaphore_t sem;
+	int count = 0;
+	int i;
+
+	lock_semaphores();
+	for (sem = semaphores; sem != NULL; sem = sem->next) {
+		count++;
+	}
+	ranked = (semaphore_sample_t*) malloc((count + 1) * sizeof(semaphore_sample_t));
+	if (ranked == NULL) {
+		atomic_clear(&semaphores_lock);
+		return;
+	}
+	/*Copy everything while no semaphore on the list can be destroyed*/
+	for (sem = semaphores, sample = ranked; sem != NULL; sem = sem->next, sample++) {
+		if (sem->name != NULL) {
+			strncpy(sample->name, sem->name, sizeof(sample->name) - 1);
+			sample->name[sizeof(sample->name) - 1] = '\0';
+		}
+		else {
+			sprintf(sample->name, "%p", (void*) sem);
+		}
+		sample->pcalls = sem->pcalls;
+		sample->pblocked = sem->pblocked;
+		sample->spins = sem->spins;
+		sample->peakwaiters = sem->peakwaiters;
+		sample->blockedcycles = sem->blockedcycles;
+		sample->maxblockedcycles = sem->maxblockedcycles;
+	}
+	atomic_clear(&semaphores_lock);
+
+	qsort(ranked, count, sizeof(semaphore_sample_t), semaphore_hotter);
+	printf("%-20s %10s %10s %12s %12s %8s %10s\n","semaphore","P","blocked",
+	       "blocked us","max us","waiters","spins");
+	for (i = 0; i < count && i < max; i++) {
+		sample = &ranked[i];
+		printf("%-20s %10ld %10ld %12llu %12llu %8d %10ld\n",
+		       sample->name, sample->pcalls, sample->pblocked,
+		       (unsigned __int64) (sample->blockedcycles / cycles_per_us),
+		       (unsigned __int64) (sample->maxblockedcycles / cycles_per_us),
+		       sample->peakwaiters, sample->spins);
+	}
+	free(ranked);
 }
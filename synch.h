@@ -47,4 +47,33 @@ extern void semaphore_P(semaphore_t sem);
 extern void semaphore_V(semaphore_t sem);
 
 
+/*
+ * Contention profiling.
+ */
+
+/*
+ * semaphore_set_name(semaphore_t sem, char* name)
+ *	Name sem in the contention report (the name is copied). Unnamed
+ *	semaphores are reported by address.
+ */
+extern void semaphore_set_name(semaphore_t sem, char* name);
+
+/*
+ * semaphore_profile(int enabled)
+ *	While enabled, every semaphore counts its P calls, the P calls that
+ *	blocked, the total and longest time spent blocked, the longest
+ *	queue of waiters and the spins taken to get its internal lock.
+ *	Only the semaphores created while it is enabled are reported, so
+ *	turn it on before creating the semaphores of interest.
+ */
+extern void semaphore_profile(int enabled);
+
+/*
+ * semaphore_report(int max)
+ *	Print the counts of the max hottest live semaphores, the ones whose
+ *	waiters spent the most time blocked first.
+ */
+extern void semaphore_report(int max);
+
+
 #endif __SYNCH_H__
@@ -0,0 +1,63 @@
+/* test4.c
+
+   Fork a batch of workers with minithread_fork_batch and join them.*/
+
+
+#include "minithread.h"
+#include "synch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WORKERS 8
+
+semaphore_t finished;
+int results[WORKERS];
+
+int square(int* arg) {
+  int i = (int) (size_t) arg;
+
+  results[i] = i * i;
+  semaphore_V(finished);
+  return 0;
+}
+
+int cube(int* arg) {
+  int i = (int) (size_t) arg;
+
+  results[i] = i * i * i;
+  semaphore_V(finished);
+  return 0;
+}
+
+int thread(int* arg) {
+  proc_t procs[WORKERS];
+  arg_t args[WORKERS];
+  minithread_t threads[WORKERS];
+  int i;
+
+  for (i = 0; i < WORKERS; i++) {
+    procs[i] = (i % 2) ? cube : square;
+    args[i] = (arg_t) (size_t) i;
+  }
+  if (minithread_fork_batch(WORKERS, procs, args, threads) == -1) {
+    printf("Could not fork the workers.\n");
+    return 0;
+  }
+  for (i = 0; i < WORKERS; i++)
+    printf("Forked worker %d as thread %d.\n", i, minithread_get_id(threads[i]));
+
+  /* join: each worker signals once as it finishes */
+  for (i = 0; i < WORKERS; i++)
+    semaphore_P(finished);
+  for (i = 0; i < WORKERS; i++)
+    printf("Worker %d computed %d.\n", i, results[i]);
+
+  return 0;
+}
+
+main() {
+  finished = semaphore_create();
+  semaphore_initialize(finished, 0);
+  minithread_system_initialize(thread, NULL);
+}
@@ -0,0 +1,71 @@
+/* test5.c
+
+   Start and fork minithreads from a host thread that is not one of the
+   virtual processors.*/
+
+
+#include "minithread.h"
+#include "synch.h"
+#include "machineprimitives.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROUNDS 5
+#define WORKERS 4
+
+minithread_t waiter;
+semaphore_t finished;
+volatile int rounds_done = 0;
+
+int worker(int* arg) {
+  printf("Worker %d forked by the foreign host thread.\n", (int) (size_t) arg);
+  semaphore_V(finished);
+  return 0;
+}
+
+/* runs on a host thread of its own: only the foreign calls are allowed */
+int foreign(int* arg) {
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    minithread_start_from_foreign(waiter);
+    /* a second start before the first takes effect would be lost */
+    while (rounds_done == i)
+      host_thread_yield();
+  }
+  for (i = 0; i < WORKERS; i++)
+    if (minithread_fork_from_foreign(worker, (arg_t) (size_t) i) == -1)
+      printf("Could not ask for worker %d.\n", i);
+  return 0;
+}
+
+int thread(int* arg) {
+  int i;
+
+  waiter = minithread_self();
+  if (host_thread_start(foreign, NULL) == -1) {
+    printf("Could not start the foreign host thread.\n");
+    return 0;
+  }
+
+  for (i = 0; i < ROUNDS; i++) {
+    minithread_stop();
+    printf("Started by the foreign host thread, round %d.\n", i);
+    rounds_done++;
+  }
+
+  for (i = 0; i < WORKERS; i++)
+    semaphore_P(finished);
+  printf("All workers finished.\n");
+
+  return 0;
+}
+
+main() {
+  finished = semaphore_create();
+  semaphore_initialize(finished, 0);
+  minithread_system_run(thread, NULL, NULL);
+  printf("Back in main.\n");
+  return 0;
+}